@@ -5,7 +5,13 @@
 
 // See minitrace.h for basic documentation.
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	// dladdr, pthread_getattr_np
+#endif
+
+#include <limits.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -19,47 +25,125 @@
 #define pthread_mutex_lock(a) EnterCriticalSection(a)
 #define pthread_mutex_unlock(a) LeaveCriticalSection(a)
 #define pthread_mutex_destroy(a) DeleteCriticalSection(a)
+// Locks that are usable before mtr_init.
+#define static_mutex_t SRWLOCK
+#define STATIC_MUTEX_INIT SRWLOCK_INIT
+#define static_mutex_init(a) InitializeSRWLock(a)
+#define static_mutex_lock(a) AcquireSRWLockExclusive(a)
+#define static_mutex_unlock(a) ReleaseSRWLockExclusive(a)
 #else
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <unistd.h>
+#define static_mutex_t pthread_mutex_t
+#define STATIC_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define static_mutex_init(a) pthread_mutex_init(a, 0)
+#define static_mutex_lock(a) pthread_mutex_lock(a)
+#define static_mutex_unlock(a) pthread_mutex_unlock(a)
+#endif
+
+#ifdef __APPLE__
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <errno.h>
+#include <linux/membarrier.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#endif
+
+#if defined(MTR_PERF_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
 #endif
 
 #include "minitrace.h"
 
+// Relaxed atomics, for ints that are read without a lock.
 #ifdef __GNUC__
 #define ATTR_NORETURN __attribute__((noreturn))
+#define ATOMIC_LOAD_INT(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ATOMIC_STORE_INT(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
 #else
 #define ATTR_NORETURN
+#define ATOMIC_LOAD_INT(p) (*(volatile int *)(p))
+#define ATOMIC_STORE_INT(p, v) (*(volatile int *)(p) = (v))
 #endif
 
 #define ARRAY_SIZE(x) sizeof(x)/sizeof(x[0])
 #define TRUE 1
 #define FALSE 0
 
+// Extra integer arguments, such as performance counter deltas, live in a second
+// buffer so that events that don't need them don't pay for them. That buffer is
+// only allocated once something uses it.
+typedef struct raw_arg {
+	const char *name;
+	int64_t value;
+} raw_arg_t;
+
 // Ugh, this struct is already pretty heavy.
-// Will probably need to move arguments to a second buffer to support more than one.
 typedef struct raw_event {
 	const char *name;
 	const char *cat;
-	void *id;
+	uint64_t id;	// Async and flow events.
 	int64_t ts;
 	uint32_t pid;
 	uint32_t tid;
 	char ph;
-	mtr_arg_type arg_type;
+	uint8_t extra_arg_count;
+	uint8_t arg_type;	// mtr_arg_type. Small, so that extra_args fits in the padding.
+	uint32_t extra_args;	// Index of the first extra argument in the buffer the event is written from.
 	const char *arg_name;
 	union {
 		const char *a_str;
 		int a_int;
-		double a_double;
 	};
+	double dur;	// X events only. Kept out of the union so X events can have an argument.
 } raw_event_t;
 
+// Per-thread state for coalescing of short scopes.
+typedef struct coalesce_state {
+	// count and has_begin are also read without the lock, so written atomically.
+	int has_begin;	// A B event that hasn't been written yet.
+	const char *begin_cat;
+	const char *begin_name;
+	double begin_time;
+	int count;	// Scopes in the current run, 0 if none.
+	const char *cat;
+	const char *name;
+	double start;
+	double end;
+	double total_dur;
+	double max_dur;
+} coalesce_state_t;
+
+typedef struct thread_info {
+	uint32_t tid;
+	int alive;
+	int written;	// Metadata is in the current output.
+	int has_sort_index;
+	int sort_index;
+	char name[64];
+	// Flushes write out other threads' pending scopes, so they take the lock too.
+	static_mutex_t coalesce_lock;
+	coalesce_state_t coalesce;
+	struct thread_info *next;
+} thread_info_t;
+
 static raw_event_t *event_buffer;
 static raw_event_t *flush_buffer;
 static volatile int event_count;
+static raw_arg_t *arg_buffer;
+static raw_arg_t *flush_arg_buffer;
+static int arg_count;
+static int is_initialized = FALSE;	// mutex and event_mutex exist.
 static int is_tracing = FALSE;
 static int is_flushing = FALSE;
 static int events_in_progress = 0;
@@ -67,6 +151,8 @@ static int64_t time_offset;
 static int first_line = 1;
 static FILE *f;
 static __thread int cur_thread_id;	// Thread local storage
+static __thread int coalesce_draining;	// Writing out held events after tracing stopped.
+static __thread int malloc_emit_blocked;	// Inside an event or registering the thread. Nothing allocates while holding mutex.
 static int cur_process_id;
 static pthread_mutex_t mutex;
 static pthread_mutex_t event_mutex;
@@ -76,6 +162,14 @@ static char *str_pool[100];
 
 // forward declaration
 void mtr_flush_with_state(int);
+static void register_fork_handlers(void);
+static void shm_detach(void);
+static void percpu_free(void);
+static void coalesce_release(thread_info_t *info);
+static void coalesce_drain(void);
+static void alloc_arg_buffers(void);
+static thread_info_t *thread_registry_current(void);
+static void thread_registry_reset(void);
 
 // Tiny portability layer.
 // Exposes:
@@ -120,8 +214,17 @@ void mtr_register_sigint_handler() {
 
 #else
 
+// Prefer the ids that other tools (perf, top, debuggers) show.
 static inline int get_cur_thread_id() {
+#if defined(__linux__)
+	return (int)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+	uint64_t tid;
+	pthread_threadid_np(NULL, &tid);
+	return (int)tid;
+#else
 	return (int)(intptr_t)pthread_self();
+#endif
 }
 static inline int get_cur_process_id() {
 	return (int)getpid();
@@ -133,23 +236,31 @@ double mtr_time_s() {
 	clock_gettime(CLOCK_MONOTONIC, &time); // Linux must use CLOCK_MONOTONIC_RAW due to time warps
 	return time.tv_sec + time.tv_nsec / 1.0e9;
 }
+// Microseconds to add to mtr_time_s to get a time that's comparable between processes.
+static int64_t time_base_us() {
+	return 0;
+}
 #else
+static time_t time_start;
 double mtr_time_s() {
-	static time_t start;
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	if (start == 0) {
-		start = tv.tv_sec;
+	if (time_start == 0) {
+		time_start = tv.tv_sec;
 	}
-	tv.tv_sec -= start;
+	tv.tv_sec -= time_start;
 	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
 }
+// Microseconds to add to mtr_time_s to get a time that's comparable between processes.
+static int64_t time_base_us() {
+	return (int64_t)time_start * 1000000;
+}
 #endif	// !BLACKBERRY
 
 static void termination_handler(int signum) ATTR_NORETURN;
 static void termination_handler(int signum) {
 	(void) signum;
-	if (is_tracing) {
+	if (is_tracing && f) {
 		printf("Ctrl-C detected! Flushing trace and shutting down.\n\n");
 		mtr_flush();
 		fwrite("\n]}\n", 1, 4, f);
@@ -169,15 +280,562 @@ void mtr_register_sigint_handler() {
 
 #endif
 
-void mtr_init_from_stream(void *stream) {
+// Sampling profiler.
+// Exposes:
+//	 mtr_sampler_*()
+//	 sampler_flush() for mtr_flush_with_state
+#ifdef __linux__
+
+#define SAMPLER_MAX_FRAMES 32
+#define SAMPLER_BUFFER_SIZE 1024	// Samples per thread between flushes. Must be a power of two.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct sample {
+	int64_t ts;
+	int depth;
+	void *frames[SAMPLER_MAX_FRAMES];	// Leaf first.
+} sample_t;
+
+// A single-producer single-consumer ring. The producer is the signal handler on
+// the owning thread, the consumer is whoever flushes.
+typedef struct sampler_thread {
+	volatile uint32_t write_pos;
+	volatile uint32_t read_pos;
+	uint32_t pid;
+	uint32_t tid;
+	uintptr_t stack_lo;
+	uintptr_t stack_hi;
+	timer_t timer;
+	int has_timer;
+	int registered;
+	struct sampler_thread *next;
+	sample_t samples[SAMPLER_BUFFER_SIZE];
+} sampler_thread_t;
+
+static pthread_mutex_t sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sampler_thread_t *sampler_threads;
+static volatile int sampler_generation;	// Bumped on stop, invalidating all thread registrations.
+static volatile int sampler_handlers_running;	// Buffers are only freed while this is 0.
+static int sampler_interval_ns;
+static __thread sampler_thread_t *cur_sampler_thread;
+static __thread int cur_sampler_generation;
+
+// Walks the frame pointer chain of the interrupted code. Only works for code built
+// with frame pointers (-fno-omit-frame-pointer), otherwise stacks will be truncated.
+static int sampler_walk_stack(sampler_thread_t *st, ucontext_t *uc, void **frames) {
+	uintptr_t pc, fp;
+	int depth = 0;
+#if defined(__x86_64__)
+	pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+	fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__i386__)
+	pc = (uintptr_t)uc->uc_mcontext.gregs[REG_EIP];
+	fp = (uintptr_t)uc->uc_mcontext.gregs[REG_EBP];
+#elif defined(__aarch64__)
+	pc = (uintptr_t)uc->uc_mcontext.pc;
+	fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#else
+	(void)uc;
+	return 0;
+#endif
+	frames[depth++] = (void *)pc;
+	while (depth < SAMPLER_MAX_FRAMES) {
+		if (fp < st->stack_lo || fp + 2 * sizeof(uintptr_t) > st->stack_hi || (fp & (sizeof(uintptr_t) - 1)))
+			break;
+		uintptr_t next_fp = ((uintptr_t *)fp)[0];
+		uintptr_t ret = ((uintptr_t *)fp)[1];
+		if (!ret)
+			break;
+		frames[depth++] = (void *)ret;
+		if (next_fp <= fp)
+			break;
+		fp = next_fp;
+	}
+	return depth;
+}
+
+static void sampler_handler(int signum, siginfo_t *info, void *ucontext) {
+	(void)signum; (void)info;
+	// Counted before looking at the registration, so that a flush that saw it
+	// still valid waits for us before freeing the buffer.
+	__atomic_add_fetch(&sampler_handlers_running, 1, __ATOMIC_SEQ_CST);
+	sampler_thread_t *st = cur_sampler_thread;
+	if (st && cur_sampler_generation == sampler_generation) {
+		int saved_errno = errno;
+		uint32_t w = st->write_pos;
+		if (w - __atomic_load_n(&st->read_pos, __ATOMIC_ACQUIRE) < SAMPLER_BUFFER_SIZE) {
+			sample_t *s = &st->samples[w & (SAMPLER_BUFFER_SIZE - 1)];
+			// mtr_time_s only calls gettimeofday, which is safe here on Linux.
+			s->ts = (int64_t)(mtr_time_s() * 1000000);
+			s->depth = sampler_walk_stack(st, (ucontext_t *)ucontext, s->frames);
+			__atomic_store_n(&st->write_pos, w + 1, __ATOMIC_RELEASE);
+		}
+		errno = saved_errno;
+	}
+	__atomic_sub_fetch(&sampler_handlers_running, 1, __ATOMIC_SEQ_CST);
+}
+
+void mtr_sampler_register_thread() {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	if (!sampler_interval_ns)
+		return;
+	if (cur_sampler_thread && cur_sampler_generation == sampler_generation)
+		return;
+	// Makes sure the thread is unregistered when it exits.
+	thread_registry_current();
+	sampler_thread_t *st = (sampler_thread_t *)calloc(1, sizeof(sampler_thread_t));
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		void *addr;
+		size_t size;
+		pthread_attr_getstack(&attr, &addr, &size);
+		st->stack_lo = (uintptr_t)addr;
+		st->stack_hi = (uintptr_t)addr + size;
+		pthread_attr_destroy(&attr);
+	}
+	st->pid = (uint32_t)getpid();
+	st->tid = (uint32_t)get_cur_thread_id();
+
+	// Counts CPU time of this thread only, so idle threads don't produce samples.
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &st->timer) == 0) {
+		struct itimerspec its;
+		its.it_interval.tv_sec = sampler_interval_ns / 1000000000;
+		its.it_interval.tv_nsec = sampler_interval_ns % 1000000000;
+		its.it_value = its.it_interval;
+		timer_settime(st->timer, 0, &its, 0);
+		st->has_timer = TRUE;
+	}
+
+	pthread_mutex_lock(&sampler_mutex);
+	st->registered = TRUE;
+	st->next = sampler_threads;
+	sampler_threads = st;
+	cur_sampler_generation = sampler_generation;
+	cur_sampler_thread = st;
+	pthread_mutex_unlock(&sampler_mutex);
+}
+
+// The buffer stays around until the next flush picks up its remaining samples.
+void mtr_sampler_unregister_thread() {
+	sampler_thread_t *st = cur_sampler_thread;
+	if (!st || cur_sampler_generation != sampler_generation)
+		return;
+	// Before a flush can see it unregistered, so our handler no longer picks it up.
+	cur_sampler_thread = 0;
+	pthread_mutex_lock(&sampler_mutex);
+	if (st->has_timer) {
+		timer_delete(st->timer);
+		st->has_timer = FALSE;
+	}
+	st->registered = FALSE;
+	pthread_mutex_unlock(&sampler_mutex);
+}
+
+void mtr_sampler_start(int hz) {
 #ifndef MTR_ENABLED
 	return;
 #endif
-	event_buffer = (raw_event_t *)malloc(INTERNAL_MINITRACE_BUFFER_SIZE * sizeof(raw_event_t));
-	flush_buffer = (raw_event_t *)malloc(INTERNAL_MINITRACE_BUFFER_SIZE * sizeof(raw_event_t));
+	struct sigaction sa;
+	if (hz <= 0 || sampler_interval_ns)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &sampler_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, 0);
+	sampler_interval_ns = 1000000000 / hz;
+	mtr_sampler_register_thread();
+}
+
+void mtr_sampler_stop() {
+	sampler_thread_t *st;
+	pthread_mutex_lock(&sampler_mutex);
+	for (st = sampler_threads; st; st = st->next) {
+		if (st->has_timer) {
+			timer_delete(st->timer);
+			st->has_timer = FALSE;
+		}
+		// The threads can't unregister anymore, so let the next flush free them.
+		st->registered = FALSE;
+	}
+	sampler_interval_ns = 0;
+	sampler_generation++;
+	pthread_mutex_unlock(&sampler_mutex);
+}
+
+// Timers aren't inherited, and the child only has the forking thread.
+static void sampler_fork_child() {
+	sampler_thread_t *st;
+	pthread_mutex_init(&sampler_mutex, 0);
+	while ((st = sampler_threads) != 0) {
+		sampler_threads = st->next;
+		free(st);
+	}
+	sampler_interval_ns = 0;
+	sampler_generation++;
+}
+
+// Symbolizes with dladdr. Frames without a dynamic symbol are written as
+// "module+0xoffset", which can be resolved offline with addr2line or a symbol map.
+static void sampler_symbolize(void *addr, char *buf, size_t size) {
+	Dl_info info;
+	// Frames walked through code without frame pointers can be garbage, which
+	// dladdr fails on without touching info.
+	int found = dladdr(addr, &info);
+	if (found && info.dli_sname) {
+		snprintf(buf, size, "%.200s", info.dli_sname);
+	} else if (found && info.dli_fname) {
+		const char *module = strrchr(info.dli_fname, '/');
+		snprintf(buf, size, "%.200s+0x%" PRIxPTR, module ? module + 1 : info.dli_fname,
+				(uintptr_t)addr - (uintptr_t)info.dli_fbase);
+	} else {
+		snprintf(buf, size, "0x%" PRIxPTR, (uintptr_t)addr);
+	}
+}
+
+// Writes out pending samples as P events, with the stack root first. Processes
+// without a file, such as those attached to a shared ring, discard them, but
+// still have to free the buffers of threads that are gone.
+static void sampler_flush(int is_last) {
+	char linebuf[8192];
+	char symbol[256];
+	sampler_thread_t *st, **link;
+	int handlers_done = FALSE;
+	pthread_mutex_lock(&sampler_mutex);
+	for (link = &sampler_threads; (st = *link) != 0;) {
+		uint32_t w = __atomic_load_n(&st->write_pos, __ATOMIC_ACQUIRE);
+		uint32_t r = f ? st->read_pos : w;
+		for (; r != w; r++) {
+			sample_t *s = &st->samples[r & (SAMPLER_BUFFER_SIZE - 1)];
+			int len = snprintf(linebuf, ARRAY_SIZE(linebuf), "%s{\"cat\":\"sample\",\"pid\":%i,\"tid\":%i,\"ts\":%" PRId64 ",\"ph\":\"P\",\"name\":\"sample\",\"args\":{},\"stack\":[",
+					first_line ? "" : ",\n", st->pid, st->tid, s->ts - time_offset);
+			int i;
+			for (i = s->depth - 1; i >= 0; i--) {
+				// Return addresses point past the call, so look up the call instruction instead.
+				sampler_symbolize((char *)s->frames[i] - (i > 0 ? 1 : 0), symbol, sizeof(symbol));
+				len += snprintf(linebuf + len, sizeof(linebuf) - len, "%s\"%s\"", i == s->depth - 1 ? "" : ",", symbol);
+				if (len >= (int)sizeof(linebuf) - 4)
+					break;
+			}
+			if (len > (int)sizeof(linebuf) - 4)
+				len = (int)sizeof(linebuf) - 4;
+			len += snprintf(linebuf + len, sizeof(linebuf) - len, "]}");
+			fwrite(linebuf, 1, len, f);
+			first_line = 0;
+		}
+		__atomic_store_n(&st->read_pos, r, __ATOMIC_RELEASE);
+		// Threads that have unregistered, or all of them when shutting down, can go.
+		if (is_last || !st->registered) {
+			// A signal sent before the timer was deleted may still be writing to it.
+			// Handlers that start after this see the registration is gone.
+			while (!handlers_done && __atomic_load_n(&sampler_handlers_running, __ATOMIC_SEQ_CST))
+				sched_yield();
+			handlers_done = TRUE;
+			*link = st->next;
+			free(st);
+		} else {
+			link = &st->next;
+		}
+	}
+	pthread_mutex_unlock(&sampler_mutex);
+}
+
+#else
+
+void mtr_sampler_start(int hz) {
+	(void)hz;
+}
+void mtr_sampler_stop() {}
+void mtr_sampler_register_thread() {}
+void mtr_sampler_unregister_thread() {}
+static void sampler_flush(int is_last) {
+	(void)is_last;
+}
+static void sampler_fork_child() {}
+
+#endif
+
+// Heap tracing.
+// libminitrace_malloc, when preloaded or linked in, is found at mtr_init. It emits
+// heap events through malloc_emit, and its per-thread allocation stats are added
+// to the scope counters.
+// Exposes:
+//	 malloc_attach() / malloc_detach() for init and shutdown
+//	 malloc_read() for the scope counters, NULL without the interposer
+typedef void (*mtr_malloc_emit_t)(const char *name, char ph, const char *arg_name, int64_t value);
+typedef void (*mtr_malloc_attach_t)(mtr_malloc_emit_t emit);
+typedef int (*mtr_malloc_read_t)(int64_t *values);
+
+static mtr_malloc_attach_t malloc_attach_fn;
+static mtr_malloc_read_t malloc_read;
+
+// Called from inside malloc. The event would go into a slot that is being filled
+// in if called during another event, or deadlock if the thread holds one of our locks.
+static void malloc_emit(const char *name, char ph, const char *arg_name, int64_t value) {
+	if (malloc_emit_blocked)
+		return;
+	internal_mtr_raw_event_arg("heap", name, ph, 0, MTR_ARG_TYPE_INT, arg_name, (void *)(intptr_t)(value > INT_MAX ? INT_MAX : value));
+}
+
+static void malloc_attach() {
+#ifdef __linux__
+	malloc_attach_fn = (mtr_malloc_attach_t)dlsym(RTLD_DEFAULT, "mtr_malloc_attach");
+	malloc_read = (mtr_malloc_read_t)dlsym(RTLD_DEFAULT, "mtr_malloc_thread_stats");
+	if (malloc_attach_fn)
+		malloc_attach_fn(&malloc_emit);
+#endif
+}
+
+static void malloc_detach() {
+	if (malloc_attach_fn)
+		malloc_attach_fn(NULL);
+	malloc_attach_fn = NULL;
+}
+
+// Per-thread performance counters.
+// Exposes:
+//	 internal_mtr_perf_read()
+//	 perf_scope_begin() / perf_scope_end() for B/E pairs
+#if defined(MTR_PERF_COUNTERS) && defined(__linux__)
+
+#define PERF_STACK_DEPTH 64
+
+typedef struct perf_counter_desc {
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} perf_counter_desc_t;
+
+static const perf_counter_desc_t perf_hw_counters[] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses" },
+};
+
+// Used when there is no PMU, which is the normal case in VMs and containers.
+static const perf_counter_desc_t perf_sw_counters[] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches" },
+};
+
+// Appended when libminitrace_malloc is loaded, in the order it reports them.
+static const char *malloc_counter_names[] = { "allocs", "alloc_bytes" };
+
+typedef struct perf_thread_state {
+	int initialized;
+	int count;	// 0 if no counters could be opened on this thread
+	int use_rdpmc;
+	int fds[MTR_PERF_MAX_COUNTERS];
+	struct perf_event_mmap_page *pages[MTR_PERF_MAX_COUNTERS];
+	const perf_counter_desc_t *desc;
+	int depth;
+	int stack_count[PERF_STACK_DEPTH];
+	int64_t stack[PERF_STACK_DEPTH][MTR_PERF_MAX_COUNTERS];
+} perf_thread_state_t;
+
+static __thread perf_thread_state_t perf_state;
+
+static void perf_close_counters(perf_thread_state_t *st) {
+	int i;
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < st->count; i++) {
+		if (st->pages[i]) {
+			munmap(st->pages[i], page_size);
+			st->pages[i] = 0;
+		}
+		close(st->fds[i]);
+	}
+	st->count = 0;
+	st->use_rdpmc = FALSE;
+}
+
+// Opens all counters in desc as one group on the calling thread, so they can be
+// read together with a single read() on the leader.
+static int perf_open_group(perf_thread_state_t *st, const perf_counter_desc_t *desc, int n, int exclude_kernel) {
+	int i;
+	long page_size = sysconf(_SC_PAGESIZE);
+	st->count = 0;
+	st->desc = desc;
+	for (i = 0; i < n; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = desc[i].type;
+		attr.config = desc[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = exclude_kernel;
+		attr.exclude_hv = 1;
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : st->fds[0], 0);
+		if (fd < 0) {
+			perf_close_counters(st);
+			return FALSE;
+		}
+		st->fds[i] = fd;
+		st->count = i + 1;
+		st->pages[i] = 0;
+#if defined(__x86_64__) || defined(__i386__)
+		void *page = mmap(0, page_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (page != MAP_FAILED) {
+			st->pages[i] = (struct perf_event_mmap_page *)page;
+		}
+#endif
+	}
+	st->use_rdpmc = TRUE;
+	for (i = 0; i < st->count; i++) {
+		if (!st->pages[i] || !st->pages[i]->cap_user_rdpmc) {
+			st->use_rdpmc = FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void perf_init_thread(perf_thread_state_t *st) {
+	// Registering the thread makes sure the counters are closed when it exits, even
+	// if it never records an event.
+	thread_registry_current();
+	st->initialized = TRUE;
+	if (perf_open_group(st, perf_hw_counters, ARRAY_SIZE(perf_hw_counters), 1))
+		return;
+	// Counting context switches requires kernel samples, which perf_event_paranoid may forbid.
+	if (perf_open_group(st, perf_sw_counters, ARRAY_SIZE(perf_sw_counters), 0))
+		return;
+	perf_open_group(st, perf_sw_counters, ARRAY_SIZE(perf_sw_counters), 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Reads a counter from user space, following the protocol described in linux/perf_event.h.
+// Fails if the counter isn't currently scheduled on a PMU.
+static int perf_rdpmc(struct perf_event_mmap_page *pc, int64_t *out) {
+	uint32_t seq, idx;
+	int64_t count;
+	do {
+		seq = pc->lock;
+		__sync_synchronize();
+		idx = pc->index;
+		if (!pc->cap_user_rdpmc || !idx)
+			return FALSE;
+		count = pc->offset;
+		uint32_t lo, hi;
+		__asm__ volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx - 1));
+		int shift = 64 - pc->pmc_width;
+		count += (int64_t)((uint64_t)lo | ((uint64_t)hi << 32)) << shift >> shift;
+		__sync_synchronize();
+	} while (pc->lock != seq);
+	*out = count;
+	return TRUE;
+}
+#endif
+
+static int perf_read_counters(int64_t *values) {
+	perf_thread_state_t *st = &perf_state;
+	int i;
+	if (!st->count)
+		return 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if (st->use_rdpmc) {
+		for (i = 0; i < st->count; i++) {
+			if (!perf_rdpmc(st->pages[i], &values[i]))
+				break;
+		}
+		if (i == st->count)
+			return st->count;
+	}
+#endif
+	uint64_t buf[1 + MTR_PERF_MAX_COUNTERS];
+	if (read(st->fds[0], buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (1 + st->count)))
+		return 0;
+	for (i = 0; i < st->count; i++) {
+		values[i] = (int64_t)buf[1 + i];
+	}
+	return st->count;
+}
+
+// The perf counters, followed by the allocation stats if the interposer is there.
+int internal_mtr_perf_read(int64_t *values) {
+	perf_thread_state_t *st = &perf_state;
+	if (!st->initialized) {
+		perf_init_thread(st);
+	}
+	int n = perf_read_counters(values);
+	if (n != st->count)
+		return 0;
+	if (malloc_read)
+		n += malloc_read(values + n);
+	return n;
+}
+
+// Called when the thread exits, and in a forked child, where the inherited
+// counters would keep counting the parent's thread.
+static void perf_reset_thread() {
+	perf_close_counters(&perf_state);
+	perf_state.initialized = FALSE;
+	perf_state.depth = 0;
+}
+
+static void perf_fill_deltas(raw_arg_t *args, int n, const int64_t *start, const int64_t *end) {
+	int i;
+	for (i = 0; i < n; i++) {
+		args[i].name = i < perf_state.count ? perf_state.desc[i].name : malloc_counter_names[i - perf_state.count];
+		args[i].value = end[i] - start[i];
+	}
+}
+
+static void perf_scope_begin() {
+	perf_thread_state_t *st = &perf_state;
+	if (st->depth < PERF_STACK_DEPTH) {
+		st->stack_count[st->depth] = internal_mtr_perf_read(st->stack[st->depth]);
+	}
+	st->depth++;
+}
+
+// Returns the number of counters written to end, or 0 if the matching begin is unknown.
+static int perf_scope_end(int64_t *end, const int64_t **start) {
+	perf_thread_state_t *st = &perf_state;
+	if (st->depth <= 0)
+		return 0;
+	st->depth--;
+	if (st->depth >= PERF_STACK_DEPTH)
+		return 0;
+	if (!st->stack_count[st->depth] || internal_mtr_perf_read(end) != st->stack_count[st->depth])
+		return 0;
+	*start = st->stack[st->depth];
+	return st->stack_count[st->depth];
+}
+
+#else
+
+int internal_mtr_perf_read(int64_t *values) {
+	(void)values;
+	return 0;
+}
+
+static void perf_reset_thread() {}
+
+#endif
+
+// Without global_buffers, events must have somewhere else to go, like the per-CPU
+// buffers.
+static void init_from_stream(void *stream, int global_buffers) {
+	if (global_buffers) {
+		event_buffer = (raw_event_t *)malloc(INTERNAL_MINITRACE_BUFFER_SIZE * sizeof(raw_event_t));
+		flush_buffer = (raw_event_t *)malloc(INTERNAL_MINITRACE_BUFFER_SIZE * sizeof(raw_event_t));
+	}
 	is_flushing = FALSE;
 	is_tracing = 1;
 	event_count = 0;
+	arg_count = 0;
 	f = (FILE *)stream;
 	const char *header = "{\"traceEvents\":[\n";
 	fwrite(header, 1, strlen(header), f);
@@ -185,6 +843,18 @@ void mtr_init_from_stream(void *stream) {
 	first_line = 1;
 	pthread_mutex_init(&mutex, 0);
 	pthread_mutex_init(&event_mutex, 0);
+	is_initialized = TRUE;
+	alloc_arg_buffers();
+	thread_registry_reset();
+	register_fork_handlers();
+	malloc_attach();
+}
+
+void mtr_init_from_stream(void *stream) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	init_from_stream(stream, TRUE);
 }
 
 void mtr_init(const char *json_file) {
@@ -199,13 +869,22 @@ void mtr_shutdown() {
 #ifndef MTR_ENABLED
 	return;
 #endif
+	// Stopped first, so that no thread holds back anything after the drain.
 	pthread_mutex_lock(&mutex);
 	is_tracing = FALSE;
 	pthread_mutex_unlock(&mutex);
+	coalesce_drain();
+	mtr_sampler_stop();
+	malloc_detach();
 	mtr_flush_with_state(TRUE);
 
-	fwrite("\n]}\n", 1, 4, f);
-	fclose(f);
+	if (f) {
+		fwrite("\n]}\n", 1, 4, f);
+		fclose(f);
+	}
+	shm_detach();
+	percpu_free();
+	is_initialized = FALSE;
 	pthread_mutex_destroy(&mutex);
 	pthread_mutex_destroy(&event_mutex);
 	f = 0;
@@ -213,6 +892,10 @@ void mtr_shutdown() {
 	event_buffer = 0;
 	free(flush_buffer);
 	flush_buffer = 0;
+	free(arg_buffer);
+	arg_buffer = 0;
+	free(flush_arg_buffer);
+	flush_arg_buffer = 0;
 	for (i = 0; i < STRING_POOL_SIZE; i++) {
 		if (str_pool[i]) {
 			free(str_pool[i]);
@@ -249,147 +932,990 @@ void mtr_stop() {
 #ifndef MTR_ENABLED
 	return;
 #endif
+	// Stopped first, so that no thread holds back anything after the drain.
 	pthread_mutex_lock(&mutex);
 	is_tracing = FALSE;
 	pthread_mutex_unlock(&mutex);
+	coalesce_drain();
 }
 
-// TODO: fwrite more than one line at a time.
-// Flushing is thread safe and process async
-// using double-buffering mechanism.
-// Aware: only one flushing process may be 
-// running at any point of time
-void mtr_flush_with_state(int is_last) {
-#ifndef MTR_ENABLED
-	return;
-#endif
-	int i = 0;
+// args is the buffer that raw->extra_args indexes into.
+static void write_event(const raw_event_t *raw, const raw_arg_t *args) {
 	char linebuf[1024];
 	char arg_buf[1024];
 	char id_buf[256];
-	int event_count_copy = 0;
-	int events_in_progress_copy = 1;
-	raw_event_t *event_buffer_tmp = NULL;
-
-	// small critical section to swap buffers
-	// - no any new events can be spawn while
-	//   swapping since they tied to the same mutex
-	// - checks for any flushing in process
-	pthread_mutex_lock(&mutex);
-	// if not flushing already
-	if (is_flushing) {
-		pthread_mutex_unlock(&mutex);
-		return;
-	}
-	is_flushing = TRUE;
-	event_count_copy = event_count;
-	event_buffer_tmp = flush_buffer;
-	flush_buffer = event_buffer;
-	event_buffer = event_buffer_tmp;
-	event_count = 0;
-	// waiting for any unfinished events before swap
-	while (events_in_progress_copy != 0) {
-		pthread_mutex_lock(&event_mutex);
-		events_in_progress_copy = events_in_progress;
-		pthread_mutex_unlock(&event_mutex);
-	}
-	pthread_mutex_unlock(&mutex);
-
-	for (i = 0; i < event_count_copy; i++) {
-		raw_event_t *raw = &flush_buffer[i];
-		int len;
-		switch (raw->arg_type) {
-		case MTR_ARG_TYPE_INT:
-			snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":%i", raw->arg_name, raw->a_int);
-			break;
-		case MTR_ARG_TYPE_STRING_CONST:
+	int len;
+	switch (raw->arg_type) {
+	case MTR_ARG_TYPE_INT:
+		snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":%i", raw->arg_name, raw->a_int);
+		break;
+	case MTR_ARG_TYPE_STRING_CONST:
+		snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":\"%s\"", raw->arg_name, raw->a_str);
+		break;
+	case MTR_ARG_TYPE_STRING_COPY:
+		if (strlen(raw->a_str) > 700) {
+			snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":\"%.*s\"", raw->arg_name, 700, raw->a_str);
+		} else {
 			snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":\"%s\"", raw->arg_name, raw->a_str);
-			break;
-		case MTR_ARG_TYPE_STRING_COPY:
-			if (strlen(raw->a_str) > 700) {
-				snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":\"%.*s\"", raw->arg_name, 700, raw->a_str);
-			} else {
-				snprintf(arg_buf, ARRAY_SIZE(arg_buf), "\"%s\":\"%s\"", raw->arg_name, raw->a_str);
-			}
-			break;
-		case MTR_ARG_TYPE_NONE:
-			arg_buf[0] = '\0';
-			break;
 		}
-		if (raw->id) {
-			switch (raw->ph) {
-			case 'S':
-			case 'T':
-			case 'F':
-				// TODO: Support full 64-bit pointers
-				snprintf(id_buf, ARRAY_SIZE(id_buf), ",\"id\":\"0x%08x\"", (uint32_t)(uintptr_t)raw->id);
-				break;
-			case 'X':
-				snprintf(id_buf, ARRAY_SIZE(id_buf), ",\"dur\":%" PRId64, (int64_t)raw->a_double);
-				break;
-			}
-		} else {
-			id_buf[0] = 0;
+		break;
+	case MTR_ARG_TYPE_NONE:
+		arg_buf[0] = '\0';
+		break;
+	}
+	if (raw->extra_arg_count) {
+		int j;
+		int arg_len = (int)strlen(arg_buf);
+		args += raw->extra_args;
+		for (j = 0; j < raw->extra_arg_count && arg_len < (int)sizeof(arg_buf); j++) {
+			arg_len += snprintf(arg_buf + arg_len, ARRAY_SIZE(arg_buf) - arg_len, "%s\"%s\":%" PRId64,
+					arg_len ? "," : "", args[j].name, args[j].value);
 		}
-		const char *cat = raw->cat;
+	}
+	switch (raw->ph) {
+	case 'S':
+	case 'T':
+	case 'F':
+	case 's':
+	case 't':
+	case 'f':
+	case 'b':
+	case 'e':
+	case 'n':
+		snprintf(id_buf, ARRAY_SIZE(id_buf), ",\"id\":\"0x%" PRIx64 "\"", raw->id);
+		break;
+	case 'X':
+		snprintf(id_buf, ARRAY_SIZE(id_buf), ",\"dur\":%" PRId64, (int64_t)raw->dur);
+		break;
+	default:
+		id_buf[0] = 0;
+		break;
+	}
+	const char *cat = raw->cat;
 #ifdef _WIN32
-		// On Windows, we often end up with backslashes in category.
-		char temp[256];
-		{
-			int len = (int)strlen(cat);
-			int i;
-			if (len > 255) len = 255;
-			for (i = 0; i < len; i++) {
-				temp[i] = cat[i] == '\\' ? '/' : cat[i];
-			}
-			temp[len] = 0;
-			cat = temp;
+	// On Windows, we often end up with backslashes in category.
+	char temp[256];
+	{
+		int len = (int)strlen(cat);
+		int i;
+		if (len > 255) len = 255;
+		for (i = 0; i < len; i++) {
+			temp[i] = cat[i] == '\\' ? '/' : cat[i];
 		}
+		temp[len] = 0;
+		cat = temp;
+	}
 #endif
 
-		len = snprintf(linebuf, ARRAY_SIZE(linebuf), "%s{\"cat\":\"%s\",\"pid\":%i,\"tid\":%i,\"ts\":%" PRId64 ",\"ph\":\"%c\",\"name\":\"%s\",\"args\":{%s}%s}",
-				first_line ? "" : ",\n",
-				cat, raw->pid, raw->tid, raw->ts - time_offset, raw->ph, raw->name, arg_buf, id_buf);
-		fwrite(linebuf, 1, len, f);
-		first_line = 0;
+	len = snprintf(linebuf, ARRAY_SIZE(linebuf), "%s{\"cat\":\"%s\",\"pid\":%i,\"tid\":%i,\"ts\":%" PRId64 ",\"ph\":\"%c\",\"name\":\"%s\",\"args\":{%s}%s}",
+			first_line ? "" : ",\n",
+			cat, raw->pid, raw->tid, raw->ts - time_offset, raw->ph, raw->name, arg_buf, id_buf);
+	fwrite(linebuf, 1, len, f);
+	first_line = 0;
+}
 
-		if (raw->arg_type == MTR_ARG_TYPE_STRING_COPY) {
-			free((void*)raw->a_str);
-		}
-		#ifdef MTR_COPY_EVENT_CATEGORY_AND_NAME
-		free(raw->name);
-		free(raw->cat);
-		#endif
+// Frees whatever the event copied, once it has been written out or dropped.
+static void free_event_strings(raw_event_t *ev) {
+	if (ev->arg_type == MTR_ARG_TYPE_STRING_COPY) {
+		free((void*)ev->a_str);
 	}
-
-	pthread_mutex_lock(&mutex);
-	is_flushing = is_last;
-	pthread_mutex_unlock(&mutex);
+	#ifdef MTR_COPY_EVENT_CATEGORY_AND_NAME
+	free((void*)ev->name);
+	free((void*)ev->cat);
+	#endif
 }
 
-void mtr_flush() {
-	mtr_flush_with_state(FALSE);
+// Multi-process tracing.
+// Events from all attached processes go through a ring in shared memory, and the
+// process that created it writes them out when it flushes, along with its own
+// events, which stay in its local buffer. Events are copied into
+// the ring with their strings inline, since pointers are meaningless in other
+// processes.
+// Exposes:
+//	 mtr_init_shared(), mtr_attach_shared()
+//	 shm_publish() for finish_event, shm_drain() for mtr_flush_with_state
+#ifndef _WIN32
+
+#define SHM_MAGIC 0x4d545253	// "MTRS"
+
+typedef struct shm_event {
+	volatile uint64_t seq;
+	int64_t ts;	// Comparable between processes, see time_base_us.
+	int64_t dur;
+	uint64_t id;
+	uint32_t pid;
+	uint32_t tid;
+	char ph;
+	uint8_t arg_type;
+	uint8_t extra_arg_count;
+	int a_int;
+	char cat[64];
+	char name[64];
+	char arg_name[32];
+	char a_str[128];
+	char extra_arg_names[MTR_PERF_MAX_COUNTERS][24];
+	int64_t extra_arg_values[MTR_PERF_MAX_COUNTERS];
+} shm_event_t;
+
+typedef struct shm_header {
+	uint32_t magic;
+	uint32_t capacity;
+	volatile uint64_t head;	// Next slot to write, claimed by producers with a CAS.
+	volatile uint64_t tail;	// Next slot to read, only touched by the owner.
+	volatile uint64_t dropped;	// Events that found the ring full.
+	shm_event_t events[1];
+} shm_header_t;
+
+static shm_header_t *shm;
+static size_t shm_size;
+static int shm_is_owner;
+static uint64_t shm_dropped_written;	// Owner only.
+static char shm_name_copy[256];
+static __thread raw_event_t shm_scratch;
+static __thread raw_arg_t shm_scratch_args[MTR_PERF_MAX_COUNTERS];
+
+static void shm_copy_str(char *dst, const char *src, size_t size) {
+	strncpy(dst, src ? src : "", size - 1);
+	dst[size - 1] = 0;
 }
 
-void internal_mtr_raw_event(const char *category, const char *name, char ph, void *id) {
-#ifndef MTR_ENABLED
-	return;
-#endif
-	pthread_mutex_lock(&mutex);
-	if (!is_tracing || event_count >= INTERNAL_MINITRACE_BUFFER_SIZE) {
-		pthread_mutex_unlock(&mutex);
-		return;
+// A bounded multi-producer queue with per-slot sequence numbers. If the ring is
+// full the event is dropped, like when the local buffer is full, and counted so
+// that the owner can note it in the trace.
+static void shm_publish(const raw_event_t *ev, const raw_arg_t *args) {
+	shm_header_t *h = shm;
+	shm_event_t *slot;
+	uint64_t pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+	int i;
+	for (;;) {
+		slot = &h->events[pos % h->capacity];
+		int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&h->head, &pos, pos + 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&h->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+		}
 	}
-	raw_event_t *ev = &event_buffer[event_count];
-	++event_count;
-	pthread_mutex_lock(&event_mutex);
+	slot->ts = ev->ts + time_base_us();
+	slot->dur = (int64_t)ev->dur;
+	slot->id = ev->id;
+	slot->pid = ev->pid;
+	slot->tid = ev->tid;
+	slot->ph = ev->ph;
+	slot->arg_type = (uint8_t)ev->arg_type;
+	shm_copy_str(slot->cat, ev->cat, sizeof(slot->cat));
+	shm_copy_str(slot->name, ev->name, sizeof(slot->name));
+	switch (ev->arg_type) {
+	case MTR_ARG_TYPE_INT:
+		shm_copy_str(slot->arg_name, ev->arg_name, sizeof(slot->arg_name));
+		slot->a_int = ev->a_int;
+		break;
+	case MTR_ARG_TYPE_STRING_CONST:
+	case MTR_ARG_TYPE_STRING_COPY:
+		shm_copy_str(slot->arg_name, ev->arg_name, sizeof(slot->arg_name));
+		shm_copy_str(slot->a_str, ev->a_str, sizeof(slot->a_str));
+		break;
+	case MTR_ARG_TYPE_NONE:
+		break;
+	}
+	slot->extra_arg_count = ev->extra_arg_count;
+	for (i = 0; i < ev->extra_arg_count; i++) {
+		shm_copy_str(slot->extra_arg_names[i], args[ev->extra_args + i].name, sizeof(slot->extra_arg_names[i]));
+		slot->extra_arg_values[i] = args[ev->extra_args + i].value;
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out everything published so far. Stops at the first slot that is still
+// being written, which will be picked up by the next flush. Drops since the last
+// drain show up as an instant event.
+static void shm_drain() {
+	shm_header_t *h = shm;
+	raw_event_t raw;
+	raw_arg_t args[MTR_PERF_MAX_COUNTERS];
+	uint64_t dropped;
+	int i;
+	if (!h || !shm_is_owner)
+		return;
+	for (;;) {
+		uint64_t pos = h->tail;
+		shm_event_t *slot = &h->events[pos % h->capacity];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		memset(&raw, 0, sizeof(raw));
+		raw.cat = slot->cat;
+		raw.name = slot->name;
+		raw.id = slot->id;
+		raw.ts = slot->ts - time_base_us();
+		raw.dur = (double)slot->dur;
+		raw.pid = slot->pid;
+		raw.tid = slot->tid;
+		raw.ph = slot->ph;
+		raw.arg_type = slot->arg_type;
+		raw.arg_name = slot->arg_name;
+		if (raw.arg_type == MTR_ARG_TYPE_INT)
+			raw.a_int = slot->a_int;
+		else
+			raw.a_str = slot->a_str;
+		raw.extra_arg_count = slot->extra_arg_count;
+		for (i = 0; i < slot->extra_arg_count; i++) {
+			args[i].name = slot->extra_arg_names[i];
+			args[i].value = slot->extra_arg_values[i];
+		}
+		write_event(&raw, args);
+		first_line = 0;
+		__atomic_store_n(&slot->seq, pos + h->capacity, __ATOMIC_RELEASE);
+		h->tail = pos + 1;
+	}
+	dropped = __atomic_load_n(&h->dropped, __ATOMIC_RELAXED);
+	if (dropped != shm_dropped_written) {
+		memset(&raw, 0, sizeof(raw));
+		raw.cat = "minitrace";
+		raw.name = "dropped_events";
+		raw.ts = (int64_t)(mtr_time_s() * 1000000);
+		raw.pid = (uint32_t)get_cur_process_id();
+		raw.tid = (uint32_t)cur_thread_id;
+		raw.ph = 'I';
+		raw.arg_type = MTR_ARG_TYPE_INT;
+		raw.arg_name = "count";
+		raw.a_int = (int)(dropped - shm_dropped_written);
+		write_event(&raw, NULL);
+		first_line = 0;
+		shm_dropped_written = dropped;
+	}
+}
+
+static int shm_map(int fd, int create) {
+	uint32_t i;
+	shm_size = sizeof(shm_header_t) + (INTERNAL_MINITRACE_SHM_BUFFER_SIZE - 1) * sizeof(shm_event_t);
+	if (create && fd >= 0 && ftruncate(fd, shm_size) != 0)
+		return FALSE;
+	void *mem = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+	if (mem == MAP_FAILED)
+		return FALSE;
+	shm = (shm_header_t *)mem;
+	if (create) {
+		shm->capacity = INTERNAL_MINITRACE_SHM_BUFFER_SIZE;
+		shm->head = 0;
+		shm->tail = 0;
+		shm->dropped = 0;
+		for (i = 0; i < shm->capacity; i++) {
+			shm->events[i].seq = i;
+		}
+		__atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+		munmap(mem, shm_size);
+		shm = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void mtr_init_shared(const char *json_file, const char *shm_name) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	int fd = -1;
+	mtr_init(json_file);
+	shm_name_copy[0] = 0;
+	if (shm_name) {
+		shm_copy_str(shm_name_copy, shm_name, sizeof(shm_name_copy));
+		fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return;
+	}
+	if (shm_map(fd, TRUE)) {
+		shm_is_owner = TRUE;
+		shm_dropped_written = 0;
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+int mtr_attach_shared(const char *shm_name) {
+#ifndef MTR_ENABLED
+	return FALSE;
+#endif
+	int fd = shm_open(shm_name, O_RDWR, 0);
+	if (fd < 0)
+		return FALSE;
+	int ok = shm_map(fd, FALSE);
+	close(fd);
+	if (!ok)
+		return FALSE;
+	pthread_mutex_init(&mutex, 0);
+	pthread_mutex_init(&event_mutex, 0);
+	is_initialized = TRUE;
+	shm_is_owner = FALSE;
+	is_tracing = TRUE;
+	register_fork_handlers();
+	return TRUE;
+}
+
+static void shm_detach() {
+	if (!shm)
+		return;
+	munmap(shm, shm_size);
+	shm = 0;
+	if (shm_is_owner && shm_name_copy[0])
+		shm_unlink(shm_name_copy);
+	shm_is_owner = FALSE;
+}
+
+#else
+
+static raw_event_t shm_scratch;
+static raw_arg_t shm_scratch_args[MTR_PERF_MAX_COUNTERS];
+static void *shm;
+static int shm_is_owner;
+static void shm_publish(const raw_event_t *ev, const raw_arg_t *args) {
+	(void)ev; (void)args;
+}
+static void shm_drain() {}
+static void shm_detach() {}
+
+void mtr_init_shared(const char *json_file, const char *shm_name) {
+	(void)shm_name;
+	mtr_init(json_file);
+}
+
+int mtr_attach_shared(const char *shm_name) {
+	(void)shm_name;
+	return FALSE;
+}
+
+#endif
+
+// Per-CPU buffers.
+// Each CPU that traces gets a pair of buffers. An event is filled in thread-locally,
+// then copied into the buffer of the CPU the thread is running on by a restartable
+// sequence. If the thread is preempted, migrated or signaled before the increment
+// of the count that commits the event, the kernel sends it back to the start, so
+// appending takes no locks or atomics. To flush, the buffers are swapped, and a
+// membarrier restarts any sequence that was still about to write to an old one.
+// Exposes:
+//	 mtr_init_percpu()
+//	 percpu_append() for finish_event, percpu_flush() for mtr_flush_with_state
+typedef struct percpu_slot {
+	uint64_t seq;	// Orders the events of a thread, which may be spread over several CPUs.
+	raw_event_t ev;
+	raw_arg_t args[MTR_PERF_MAX_COUNTERS];
+} percpu_slot_t;
+
+#if defined(__linux__) && defined(__x86_64__)
+
+typedef struct percpu_buffer {
+	uint32_t count;	// Only written by the commit of an append, or while swapped out.
+	percpu_slot_t slots[INTERNAL_MINITRACE_PERCPU_BUFFER_SIZE];
+} percpu_buffer_t;
+
+typedef struct percpu_run {
+	int pos;
+	int end;
+} percpu_run_t;
+
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ (1 << 7)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ (1 << 8)
+#endif
+
+// Offsets into struct rseq, see linux/rseq.h.
+#define RSEQ_CPU_ID_OFFSET 4
+#define RSEQ_CS_OFFSET 8
+
+// glibc registers an rseq area for every thread. Weak, so older glibc still links.
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static int percpu_enabled = FALSE;
+static int percpu_ncpus;
+static percpu_buffer_t **percpu_current;
+static percpu_buffer_t **percpu_spare;
+static __thread percpu_slot_t percpu_scratch;
+static __thread uint64_t percpu_seq;
+static uint64_t percpu_seq_base;	// Each thread's percpu_seq starts from a new multiple of 2^32.
+
+static inline char *percpu_rseq_area() {
+	char *tp;
+	__asm__("movq %%fs:0, %0" : "=r"(tp));
+	return tp + __rseq_offset;
+}
+
+// Returns 0 on success, -1 if the buffer is full and -2 if the CPU has no buffer yet.
+static int percpu_try_append(const percpu_slot_t *slot, size_t size) {
+	int ret;
+	__asm__ __volatile__(
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		"0:\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs_offset](%[rseq])\n\t"
+		"1:\n\t"
+		"movl %c[cpu_offset](%[rseq]), %%eax\n\t"
+		"cmpl %[ncpus], %%eax\n\t"
+		"jae 5f\n\t"
+		"movq (%[buffers], %%rax, 8), %%rdx\n\t"
+		"testq %%rdx, %%rdx\n\t"
+		"jz 6f\n\t"
+		"movl (%%rdx), %%eax\n\t"
+		"cmpl %[capacity], %%eax\n\t"
+		"jae 5f\n\t"
+		"imulq %[slot_size], %%rax, %%rax\n\t"
+		"leaq %c[slots_offset](%%rdx, %%rax), %%rdi\n\t"
+		"movq %[src], %%rsi\n\t"
+		"movq %[size], %%rcx\n\t"
+		"rep movsb\n\t"
+		"addl $1, (%%rdx)\n\t"
+		"2:\n\t"
+		"xorl %[ret], %[ret]\n\t"
+		"jmp 7f\n\t"
+		// The kernel checks for this signature (RSEQ_SIG) right before the abort handler.
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long 0x53053053\n\t"
+		"4:\n\t"
+		"jmp 0b\n\t"
+		"5:\n\t"
+		"movl $-1, %[ret]\n\t"
+		"jmp 7f\n\t"
+		"6:\n\t"
+		"movl $-2, %[ret]\n\t"
+		"7:\n\t"
+		: [ret] "=&r"(ret)
+		: [rseq] "r"(percpu_rseq_area()), [buffers] "r"(percpu_current), [ncpus] "r"(percpu_ncpus),
+		  [src] "r"(slot), [size] "r"(size),
+		  [capacity] "i"(INTERNAL_MINITRACE_PERCPU_BUFFER_SIZE), [slot_size] "i"(sizeof(percpu_slot_t)),
+		  [slots_offset] "i"(offsetof(percpu_buffer_t, slots)),
+		  [cs_offset] "i"(RSEQ_CS_OFFSET), [cpu_offset] "i"(RSEQ_CPU_ID_OFFSET)
+		: "rax", "rcx", "rdx", "rsi", "rdi", "memory", "cc");
+	return ret;
+}
+
+static percpu_buffer_t *percpu_alloc_buffer() {
+	percpu_buffer_t *buf = (percpu_buffer_t *)malloc(sizeof(percpu_buffer_t));
+	if (buf)
+		buf->count = 0;
+	return buf;
+}
+
+// Returns FALSE if the event was dropped because the buffer is full.
+static int percpu_append(percpu_slot_t *slot) {
+	size_t size = offsetof(percpu_slot_t, args) + slot->ev.extra_arg_count * sizeof(raw_arg_t);
+	int tries;
+	// A thread that reuses the tid of one that exited since the last flush has to
+	// sort after it, so it can't start from 0.
+	if (!percpu_seq)
+		percpu_seq = __atomic_add_fetch(&percpu_seq_base, (uint64_t)1 << 32, __ATOMIC_RELAXED);
+	slot->seq = percpu_seq++;
+	for (tries = 0; tries < 4; tries++) {
+		int ret = percpu_try_append(slot, size);
+		if (ret == 0)
+			return TRUE;
+		if (ret == -1)
+			return FALSE;
+		// First event on this CPU. We may have migrated by the time the buffer is
+		// there, hence the retries. Heap events are blocked here, since we are
+		// inside an event.
+		int cpu = sched_getcpu();
+		pthread_mutex_lock(&mutex);
+		if (percpu_enabled && cpu >= 0 && cpu < percpu_ncpus && !percpu_current[cpu]) {
+			__atomic_store_n(&percpu_current[cpu], percpu_alloc_buffer(), __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	return FALSE;
+}
+
+// Events of each thread stay in the order they were committed, and threads are
+// merged by the time the event was emitted (the end, for X events).
+static int64_t percpu_emit_time(const percpu_slot_t *slot) {
+	return slot->ev.ph == 'X' ? slot->ev.ts + (int64_t)slot->ev.dur : slot->ev.ts;
+}
+
+static int percpu_compare(const void *a, const void *b) {
+	const percpu_slot_t *x = *(const percpu_slot_t * const *)a;
+	const percpu_slot_t *y = *(const percpu_slot_t * const *)b;
+	if (x->ev.tid != y->ev.tid)
+		return x->ev.tid < y->ev.tid ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int percpu_run_before(percpu_slot_t **order, const percpu_run_t *x, const percpu_run_t *y) {
+	return percpu_emit_time(order[x->pos]) < percpu_emit_time(order[y->pos]);
+}
+
+static void percpu_sift_down(percpu_slot_t **order, percpu_run_t *heap, int n, int i) {
+	for (;;) {
+		int child = 2 * i + 1;
+		percpu_run_t tmp;
+		if (child >= n)
+			return;
+		if (child + 1 < n && percpu_run_before(order, &heap[child + 1], &heap[child]))
+			child++;
+		if (!percpu_run_before(order, &heap[child], &heap[i]))
+			return;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+// Called from mtr_flush_with_state, so only one flush runs at a time.
+static void percpu_flush() {
+	int cpu, i;
+	int n = 0;
+	int num_runs = 0;
+	percpu_slot_t **order;
+	percpu_run_t *runs;
+	if (!percpu_enabled)
+		return;
+
+	// Allocated before taking the lock, since a heap event from the allocation may
+	// need it to get a buffer for the CPU it runs on.
+	for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+		if (__atomic_load_n(&percpu_current[cpu], __ATOMIC_ACQUIRE) && !percpu_spare[cpu])
+			percpu_spare[cpu] = percpu_alloc_buffer();
+	}
+	pthread_mutex_lock(&mutex);
+	for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+		percpu_buffer_t *full = percpu_current[cpu];
+		// CPUs that got a buffer since then are swapped on the next flush.
+		if (!full || !percpu_spare[cpu])
+			continue;
+		percpu_spare[cpu]->count = 0;
+		__atomic_store_n(&percpu_current[cpu], percpu_spare[cpu], __ATOMIC_RELEASE);
+		percpu_spare[cpu] = full;
+	}
+	pthread_mutex_unlock(&mutex);
+	syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+
+	// From here on, nothing writes to the spare buffers.
+	for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+		if (percpu_spare[cpu])
+			n += percpu_spare[cpu]->count;
+	}
+	if (!n)
+		return;
+	order = (percpu_slot_t **)malloc(n * sizeof(percpu_slot_t *));
+	runs = (percpu_run_t *)malloc(n * sizeof(percpu_run_t));
+	if (!order || !runs) {
+		free(order);
+		free(runs);
+		return;
+	}
+	n = 0;
+	for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+		percpu_buffer_t *buf = percpu_spare[cpu];
+		uint32_t j;
+		for (j = 0; buf && j < buf->count; j++) {
+			order[n++] = &buf->slots[j];
+		}
+		if (buf)
+			buf->count = 0;
+	}
+	qsort(order, n, sizeof(percpu_slot_t *), &percpu_compare);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || order[i]->ev.tid != order[i - 1]->ev.tid) {
+			runs[num_runs].pos = i;
+			num_runs++;
+		}
+		runs[num_runs - 1].end = i + 1;
+	}
+	for (i = num_runs / 2 - 1; i >= 0; i--) {
+		percpu_sift_down(order, runs, num_runs, i);
+	}
+	while (num_runs > 0) {
+		percpu_slot_t *slot = order[runs[0].pos++];
+		raw_event_t *raw = &slot->ev;
+		if (f) {
+			write_event(raw, slot->args);
+		}
+		free_event_strings(raw);
+		if (runs[0].pos == runs[0].end)
+			runs[0] = runs[--num_runs];
+		percpu_sift_down(order, runs, num_runs, 0);
+	}
+	free(order);
+	free(runs);
+}
+
+int mtr_init_percpu(const char *json_file) {
+#ifndef MTR_ENABLED
+	return FALSE;
+#endif
+	// Falls back to the global buffers if anything is missing.
+	if (!&__rseq_size || !&__rseq_offset || __rseq_size == 0 ||
+			// Not registered for this thread, for example if rseq was disabled with a tunable.
+			*(volatile int32_t *)(percpu_rseq_area() + RSEQ_CPU_ID_OFFSET) < 0 ||
+			syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) != 0) {
+		mtr_init(json_file);
+		return FALSE;
+	}
+	percpu_ncpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+	percpu_current = (percpu_buffer_t **)calloc(percpu_ncpus, sizeof(percpu_buffer_t *));
+	percpu_spare = (percpu_buffer_t **)calloc(percpu_ncpus, sizeof(percpu_buffer_t *));
+	if (!percpu_current || !percpu_spare) {
+		percpu_free();
+		mtr_init(json_file);
+		return FALSE;
+	}
+	// Before tracing starts, since the global path has no buffers to fall back to.
+	percpu_enabled = TRUE;
+	init_from_stream(fopen(json_file, "wb"), FALSE);
+	return TRUE;
+}
+
+static void percpu_free() {
+	int cpu;
+	for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+		free(percpu_current[cpu]);
+		free(percpu_spare[cpu]);
+	}
+	free(percpu_current);
+	percpu_current = 0;
+	free(percpu_spare);
+	percpu_spare = 0;
+	percpu_ncpus = 0;
+	percpu_enabled = FALSE;
+}
+
+#else
+
+static percpu_slot_t percpu_scratch;
+static int percpu_enabled = FALSE;
+static int percpu_append(percpu_slot_t *slot) {
+	(void)slot;
+	return FALSE;
+}
+static void percpu_flush() {}
+static void percpu_free() {}
+
+int mtr_init_percpu(const char *json_file) {
+	mtr_init(json_file);
+	return FALSE;
+}
+
+#endif
+
+// Thread registry.
+// Keeps track of every thread that has traced anything. Thread names and sort
+// indices are stored here rather than buffered as events, and written once per
+// output. A thread-specific key with a destructor lets exiting threads release
+// their resources and hand over anything still pending.
+static static_mutex_t thread_registry_mutex = STATIC_MUTEX_INIT;
+static thread_info_t *thread_registry;
+static int thread_key_created = FALSE;
+static __thread thread_info_t *cur_thread_info;
+
+static void thread_exit(void *param) {
+	thread_info_t *info = (thread_info_t *)param;
+	coalesce_release(info);
+	mtr_sampler_unregister_thread();
+	perf_reset_thread();
+	static_mutex_lock(&thread_registry_mutex);
+	info->alive = FALSE;
+	static_mutex_unlock(&thread_registry_mutex);
+	cur_thread_info = 0;
+}
+
+#ifdef _WIN32
+static DWORD thread_key;
+static VOID NTAPI thread_exit_fls(PVOID param) {
+	if (param)
+		thread_exit(param);
+}
+#define create_thread_key() (thread_key = FlsAlloc(&thread_exit_fls))
+#define set_thread_key(info) FlsSetValue(thread_key, info)
+#else
+static pthread_key_t thread_key;
+#define create_thread_key() pthread_key_create(&thread_key, &thread_exit)
+#define set_thread_key(info) pthread_setspecific(thread_key, info)
+#endif
+
+static thread_info_t *thread_registry_current() {
+	thread_info_t *info = cur_thread_info;
+	if (info)
+		return info;
+	int blocked = malloc_emit_blocked;
+	malloc_emit_blocked = TRUE;
+	info = (thread_info_t *)calloc(1, sizeof(thread_info_t));
+	malloc_emit_blocked = blocked;
+	info->tid = (uint32_t)get_cur_thread_id();
+	info->alive = TRUE;
+	static_mutex_init(&info->coalesce_lock);
+	static_mutex_lock(&thread_registry_mutex);
+	if (!thread_key_created) {
+		create_thread_key();
+		thread_key_created = TRUE;
+	}
+	info->next = thread_registry;
+	thread_registry = info;
+	static_mutex_unlock(&thread_registry_mutex);
+	set_thread_key(info);
+	cur_thread_info = info;
+	return info;
+}
+
+// Metadata from processes that don't write the file has to go through the shared ring.
+static void thread_registry_publish(thread_info_t *info) {
+	if (!shm || shm_is_owner)
+		return;
+	if (info->name[0])
+		internal_mtr_raw_event_arg("", "thread_name", 'M', 0, MTR_ARG_TYPE_STRING_CONST, "name", info->name);
+	if (info->has_sort_index)
+		internal_mtr_raw_event_arg("", "thread_sort_index", 'M', 0, MTR_ARG_TYPE_INT, "sort_index", (void *)(intptr_t)info->sort_index);
+}
+
+void mtr_set_thread_name(const char *name) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	thread_info_t *info = thread_registry_current();
+	static_mutex_lock(&thread_registry_mutex);
+	strncpy(info->name, name, sizeof(info->name) - 1);
+	info->written = FALSE;
+	static_mutex_unlock(&thread_registry_mutex);
+	thread_registry_publish(info);
+}
+
+void mtr_set_thread_sort_index(int sort_index) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	thread_info_t *info = thread_registry_current();
+	static_mutex_lock(&thread_registry_mutex);
+	info->sort_index = sort_index;
+	info->has_sort_index = TRUE;
+	info->written = FALSE;
+	static_mutex_unlock(&thread_registry_mutex);
+	thread_registry_publish(info);
+}
+
+// Called when starting a new output.
+static void thread_registry_reset() {
+	thread_info_t *info;
+	static_mutex_lock(&thread_registry_mutex);
+	for (info = thread_registry; info; info = info->next) {
+		info->written = FALSE;
+	}
+	static_mutex_unlock(&thread_registry_mutex);
+}
+
+// Writes metadata that isn't in the output yet, and forgets exited threads once
+// their metadata has been written.
+static void thread_registry_flush() {
+	raw_event_t raw;
+	thread_info_t *info, **link;
+	memset(&raw, 0, sizeof(raw));
+	raw.cat = "";
+	raw.ph = 'M';
+	raw.pid = (uint32_t)get_cur_process_id();
+	raw.ts = time_offset;
+	static_mutex_lock(&thread_registry_mutex);
+	for (link = &thread_registry; (info = *link) != 0;) {
+		if (!info->written) {
+			raw.tid = info->tid;
+			if (info->name[0]) {
+				raw.name = "thread_name";
+				raw.arg_type = MTR_ARG_TYPE_STRING_CONST;
+				raw.arg_name = "name";
+				raw.a_str = info->name;
+				write_event(&raw, NULL);
+				first_line = 0;
+			}
+			if (info->has_sort_index) {
+				raw.name = "thread_sort_index";
+				raw.arg_type = MTR_ARG_TYPE_INT;
+				raw.arg_name = "sort_index";
+				raw.a_int = info->sort_index;
+				write_event(&raw, NULL);
+				first_line = 0;
+			}
+			info->written = TRUE;
+		}
+		if (!info->alive) {
+			*link = info->next;
+			free(info);
+		} else {
+			link = &info->next;
+		}
+	}
+	static_mutex_unlock(&thread_registry_mutex);
+}
+
+// Only the forking thread survives, with a new id.
+static void thread_registry_fork_child() {
+	thread_info_t *info;
+	static_mutex_init(&thread_registry_mutex);
+	while ((info = thread_registry) != 0) {
+		thread_registry = info->next;
+		if (info != cur_thread_info)
+			free(info);
+	}
+	info = cur_thread_info;
+	if (info) {
+		info->tid = (uint32_t)get_cur_thread_id();
+		info->written = FALSE;
+		static_mutex_init(&info->coalesce_lock);
+		info->next = 0;
+		thread_registry = info;
+	}
+}
+
+// TODO: fwrite more than one line at a time.
+// Flushing is thread safe and process async
+// using double-buffering mechanism.
+// Aware: only one flushing process may be 
+// running at any point of time
+void mtr_flush_with_state(int is_last) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	int i = 0;
+	int event_count_copy = 0;
+	int events_in_progress_copy = 1;
+	raw_event_t *event_buffer_tmp = NULL;
+	raw_arg_t *arg_buffer_tmp = NULL;
+
+	coalesce_drain();
+
+	// small critical section to swap buffers
+	// - no any new events can be spawn while
+	//   swapping since they tied to the same mutex
+	// - checks for any flushing in process
+	pthread_mutex_lock(&mutex);
+	// if not flushing already
+	if (is_flushing) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	is_flushing = TRUE;
+	event_count_copy = event_count;
+	event_buffer_tmp = flush_buffer;
+	flush_buffer = event_buffer;
+	event_buffer = event_buffer_tmp;
+	event_count = 0;
+	arg_buffer_tmp = flush_arg_buffer;
+	flush_arg_buffer = arg_buffer;
+	arg_buffer = arg_buffer_tmp;
+	arg_count = 0;
+	// waiting for any unfinished events before swap
+	while (events_in_progress_copy != 0) {
+		pthread_mutex_lock(&event_mutex);
+		events_in_progress_copy = events_in_progress;
+		pthread_mutex_unlock(&event_mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (f) {
+		thread_registry_flush();
+	}
+	for (i = 0; i < event_count_copy; i++) {
+		raw_event_t *raw = &flush_buffer[i];
+		if (f) {
+			write_event(raw, flush_arg_buffer);
+		}
+
+		free_event_strings(raw);
+	}
+	percpu_flush();
+	if (f) {
+		shm_drain();
+	}
+	sampler_flush(is_last);
+
+	pthread_mutex_lock(&mutex);
+	is_flushing = is_last;
+	pthread_mutex_unlock(&mutex);
+}
+
+void mtr_flush() {
+	mtr_flush_with_state(FALSE);
+}
+
+// Reserves a slot in the event buffer, plus extra_args slots in the argument buffer,
+// which are returned in args. Returns NULL if not tracing or out of space. Otherwise,
+// finish_event(ev) must be called once the event has been filled in. Heap events
+// can't be emitted in between. If the argument buffer is full, the event gets no
+// extra arguments, so callers fill in ev->extra_arg_count of them.
+static raw_event_t *begin_event(int extra_args, raw_arg_t **args) {
+	raw_event_t *ev;
+	thread_info_t *info = cur_thread_info;
+	// Other threads only ever clear the state, so checking without the lock is enough.
+	if (info && (ATOMIC_LOAD_INT(&info->coalesce.count) || ATOMIC_LOAD_INT(&info->coalesce.has_begin)))
+		coalesce_release(info);
+	if (shm && !shm_is_owner) {
+		// Filled in thread-locally and copied to shared memory by finish_event.
+		if (!is_tracing && !coalesce_draining)
+			return NULL;
+		ev = &shm_scratch;
+		ev->extra_arg_count = (uint8_t)extra_args;
+		ev->extra_args = 0;
+		*args = shm_scratch_args;
+		malloc_emit_blocked = TRUE;
+		return ev;
+	}
+	if (percpu_enabled) {
+		// Filled in thread-locally and copied to this CPU's buffer by finish_event.
+		if (!is_tracing && !coalesce_draining)
+			return NULL;
+		ev = &percpu_scratch.ev;
+		ev->extra_arg_count = (uint8_t)extra_args;
+		ev->extra_args = 0;
+		*args = percpu_scratch.args;
+		malloc_emit_blocked = TRUE;
+		return ev;
+	}
+	pthread_mutex_lock(&mutex);
+	if ((!is_tracing && !coalesce_draining) || event_count >= INTERNAL_MINITRACE_BUFFER_SIZE) {
+		pthread_mutex_unlock(&mutex);
+		return NULL;
+	}
+	// An E event without its deltas is still better than an unclosed slice.
+	if (!arg_buffer || arg_count + extra_args > INTERNAL_MINITRACE_ARG_BUFFER_SIZE)
+		extra_args = 0;
+	ev = &event_buffer[event_count];
+	++event_count;
+	ev->extra_arg_count = (uint8_t)extra_args;
+	ev->extra_args = (uint32_t)arg_count;
+	*args = arg_buffer + arg_count;
+	arg_count += extra_args;
+	pthread_mutex_lock(&event_mutex);
 	++events_in_progress;
 	pthread_mutex_unlock(&event_mutex);
 	pthread_mutex_unlock(&mutex);
+	malloc_emit_blocked = TRUE;
+	return ev;
+}
+
+static void finish_event(raw_event_t *ev) {
+	if (ev == &shm_scratch) {
+		shm_publish(ev, shm_scratch_args);
+		free_event_strings(ev);
+	} else if (ev == &percpu_scratch.ev) {
+		if (!percpu_append(&percpu_scratch)) {
+			free_event_strings(ev);
+		}
+	} else {
+		pthread_mutex_lock(&event_mutex);
+		--events_in_progress;
+		pthread_mutex_unlock(&event_mutex);
+	}
+	malloc_emit_blocked = FALSE;
+}
 
+static void fill_event(raw_event_t *ev, const char *category, const char *name, char ph, void *id) {
 	double ts = mtr_time_s();
 	if (!cur_thread_id) {
-		cur_thread_id = get_cur_thread_id();
+		cur_thread_id = (int)thread_registry_current()->tid;
 	}
 	if (!cur_process_id) {
 		cur_process_id = get_cur_process_id();
@@ -409,68 +1935,261 @@ void internal_mtr_raw_event(const char *category, const char *name, char ph, voi
 	ev->name = name;
 #endif
 
-	ev->id = id;
+	ev->id = (uint64_t)(uintptr_t)id;
 	ev->ph = ph;
 	if (ev->ph == 'X') {
 		double x;
 		memcpy(&x, id, sizeof(double));
 		ev->ts = (int64_t)(x * 1000000);
-		ev->a_double = (ts - x) * 1000000;
+		ev->dur = (ts - x) * 1000000;
 	} else {
 		ev->ts = (int64_t)(ts * 1000000);
 	}
 	ev->tid = cur_thread_id;
 	ev->pid = cur_process_id;
 	ev->arg_type = MTR_ARG_TYPE_NONE;
+}
 
-	pthread_mutex_lock(&event_mutex);
-	--events_in_progress;
-	pthread_mutex_unlock(&event_mutex);
+// For B/E pairs, snapshots the counters on B and computes the deltas on E.
+// Returns the number of deltas to attach to the event.
+static int scope_counters(char ph, int64_t *end, const int64_t **start) {
+#ifdef MTR_PERF_COUNTERS
+	if (ph == 'B') {
+		perf_scope_begin();
+	} else if (ph == 'E') {
+		return perf_scope_end(end, start);
+	}
+#else
+	(void)ph; (void)end; (void)start;
+#endif
+	return 0;
 }
 
-void internal_mtr_raw_event_arg(const char *category, const char *name, char ph, void *id, mtr_arg_type arg_type, const char *arg_name, void *arg_value) {
-#ifndef MTR_ENABLED
-	return;
+// Coalescing.
+// With coalescing on, a B event is held back until the next event on the thread.
+// If that is the matching E and the scope was short, the scope joins the current
+// run instead of being written. Anything else writes out the run and the held B
+// first, so the output order is unchanged. The state lives in the thread registry,
+// so that flushes can write out what other threads are still holding.
+// Exposes:
+//	 mtr_set_coalescing_us()
+//	 coalesce_event() for scope events, coalesce_release() for everything else
+//	 coalesce_drain() for flushes and when tracing stops
+static double coalesce_max_dur_s;
+static double coalesce_max_gap_s;
+
+void mtr_set_coalescing_us(int max_dur_us, int max_gap_us) {
+	coalesce_max_dur_s = max_dur_us / 1000000.0;
+	coalesce_max_gap_s = max_gap_us / 1000000.0;
+	alloc_arg_buffers();
+}
+
+// Coalesced runs and counter deltas are the only users of the argument buffers.
+static void alloc_arg_buffers() {
+	raw_arg_t *a, *b;
+#ifndef MTR_PERF_COUNTERS
+	if (coalesce_max_dur_s <= 0.0)
+		return;
 #endif
-	pthread_mutex_lock(&mutex);
-	if (!is_tracing || event_count >= INTERNAL_MINITRACE_BUFFER_SIZE) {
-		pthread_mutex_unlock(&mutex);
+	// Not initialized, or not using the global buffers.
+	if (!event_buffer)
 		return;
+	a = (raw_arg_t *)malloc(INTERNAL_MINITRACE_ARG_BUFFER_SIZE * sizeof(raw_arg_t));
+	b = (raw_arg_t *)malloc(INTERNAL_MINITRACE_ARG_BUFFER_SIZE * sizeof(raw_arg_t));
+	// Events reserved before this have no extra arguments, whichever buffer they are in.
+	pthread_mutex_lock(&mutex);
+	if (a && b && !arg_buffer) {
+		arg_buffer = a;
+		flush_arg_buffer = b;
+		a = b = 0;
 	}
-	raw_event_t *ev = &event_buffer[event_count];
-	++event_count;
-	pthread_mutex_lock(&event_mutex);
-	++events_in_progress;
-	pthread_mutex_unlock(&event_mutex);
 	pthread_mutex_unlock(&mutex);
+	free(a);
+	free(b);
+}
 
-	if (!cur_thread_id) {
-		cur_thread_id = get_cur_thread_id();
+// The writers may run on another thread than the one the scopes belong to.
+static void coalesce_write_run(uint32_t tid, const coalesce_state_t *c) {
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(c->count > 1 ? 3 : 0, &args);
+	if (!ev)
+		return;
+	fill_event(ev, c->cat, c->name, 'X', (void *)&c->start);
+	ev->tid = tid;
+	ev->dur = (c->end - c->start) * 1000000;
+	if (ev->extra_arg_count) {
+		args[0].name = "count";
+		args[0].value = c->count;
+		args[1].name = "total_dur";
+		args[1].value = (int64_t)(c->total_dur * 1000000);
+		args[2].name = "max_dur";
+		args[2].value = (int64_t)(c->max_dur * 1000000);
 	}
-	if (!cur_process_id) {
-		cur_process_id = get_cur_process_id();
+	finish_event(ev);
+}
+
+static void coalesce_write_begin(uint32_t tid, const coalesce_state_t *c) {
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(0, &args);
+	if (!ev)
+		return;
+	fill_event(ev, c->begin_cat, c->begin_name, 'B', 0);
+	ev->tid = tid;
+	ev->ts = (int64_t)(c->begin_time * 1000000);
+	finish_event(ev);
+}
+
+// Writes out a thread's run and held B event, in that order. The caller holds the
+// thread's coalesce_lock.
+static void coalesce_write_pending(thread_info_t *info) {
+	coalesce_state_t c = info->coalesce;
+	// Cleared first, since writing goes through begin_event.
+	ATOMIC_STORE_INT(&info->coalesce.count, 0);
+	ATOMIC_STORE_INT(&info->coalesce.has_begin, FALSE);
+	if (c.count)
+		coalesce_write_run(info->tid, &c);
+	if (c.has_begin)
+		coalesce_write_begin(info->tid, &c);
+}
+
+static void coalesce_release(thread_info_t *info) {
+	static_mutex_lock(&info->coalesce_lock);
+	coalesce_write_pending(info);
+	static_mutex_unlock(&info->coalesce_lock);
+}
+
+// Writes out what every thread is holding, even if tracing has just stopped. A
+// thread that was holding a B event writes its E normally.
+static void coalesce_drain() {
+	thread_info_t *self, *info;
+	// Registered up front, since writing mustn't register the calling thread while
+	// the registry is locked. Its own scopes go first, so that writing the others
+	// doesn't have to release them.
+	self = thread_registry_current();
+	coalesce_draining = TRUE;
+	coalesce_release(self);
+	static_mutex_lock(&thread_registry_mutex);
+	for (info = thread_registry; info; info = info->next) {
+		coalesce_release(info);
 	}
-	double ts = mtr_time_s();
+	static_mutex_unlock(&thread_registry_mutex);
+	coalesce_draining = FALSE;
+}
 
-#ifdef MTR_COPY_EVENT_CATEGORY_AND_NAME
-	const size_t category_len = strlen(category);
-	ev->cat = malloc(category_len + 1);
-	strcpy(ev->cat, category);
+// Starts a new run unless the scope continues the current one. The caller holds
+// the thread's coalesce_lock.
+static void coalesce_add(thread_info_t *info, const char *category, const char *name, double start, double end) {
+	coalesce_state_t *c = &info->coalesce;
+	if (c->count && (c->cat != category || c->name != name || start - c->end > coalesce_max_gap_s)) {
+		coalesce_state_t run = *c;
+		ATOMIC_STORE_INT(&c->count, 0);
+		coalesce_write_run(info->tid, &run);
+	}
+	if (!c->count) {
+		c->cat = category;
+		c->name = name;
+		c->start = start;
+		c->total_dur = 0.0;
+		c->max_dur = 0.0;
+	}
+	ATOMIC_STORE_INT(&c->count, c->count + 1);
+	c->end = end;
+	c->total_dur += end - start;
+	if (end - start > c->max_dur)
+		c->max_dur = end - start;
+}
 
-	const size_t name_len = strlen(name);
-	ev->name = malloc(name_len + 1);
-	strcpy(ev->name, name);
+// Returns TRUE if the event was held back or merged, and must not be written.
+static int coalesce_event(const char *category, const char *name, char ph, void *id) {
+	thread_info_t *info;
+	coalesce_state_t *c;
+	double now, start;
+	int held = FALSE;
+	if (coalesce_max_dur_s <= 0.0 || !is_tracing || (ph != 'B' && ph != 'E' && ph != 'X'))
+		return FALSE;
+	now = mtr_time_s();
+	// Makes sure pending scopes are written if the thread exits.
+	info = thread_registry_current();
+	c = &info->coalesce;
+	static_mutex_lock(&info->coalesce_lock);
+	switch (ph) {
+	case 'B':
+		// Nested, or a different scope than the run. Write out what we have.
+		if (c->has_begin || (c->count && (c->cat != category || c->name != name)))
+			coalesce_write_pending(info);
+		ATOMIC_STORE_INT(&c->has_begin, TRUE);
+		c->begin_cat = category;
+		c->begin_name = name;
+		c->begin_time = now;
+		held = TRUE;
+		break;
+	case 'E':
+		// Without a held B, e.g. because a flush wrote it, the E is written as is.
+		if (!c->has_begin || c->begin_cat != category || c->begin_name != name)
+			break;
+		if (now - c->begin_time > coalesce_max_dur_s)
+			break;
+		ATOMIC_STORE_INT(&c->has_begin, FALSE);
+		coalesce_add(info, category, name, c->begin_time, now);
+		held = TRUE;
+		break;
+	case 'X':
+		if (c->has_begin)
+			break;
+		memcpy(&start, id, sizeof(double));
+		if (now - start > coalesce_max_dur_s)
+			break;
+		coalesce_add(info, category, name, start, now);
+		held = TRUE;
+		break;
+	}
+	static_mutex_unlock(&info->coalesce_lock);
+	return held;
+}
 
+void internal_mtr_raw_event(const char *category, const char *name, char ph, void *id) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	int64_t perf_end[MTR_PERF_MAX_COUNTERS];
+	const int64_t *perf_start = NULL;
+	int perf_count = scope_counters(ph, perf_end, &perf_start);
+	if (coalesce_event(category, name, ph, id))
+		return;
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(perf_count, &args);
+	if (!ev)
+		return;
+	fill_event(ev, category, name, ph, id);
+#ifdef MTR_PERF_COUNTERS
+	perf_fill_deltas(args, ev->extra_arg_count, perf_start, perf_end);
+#endif
+	finish_event(ev);
+}
+
+void internal_mtr_raw_event_perf(const char *category, const char *name, void *id, const int64_t *start_values) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+#ifdef MTR_PERF_COUNTERS
+	int64_t perf_end[MTR_PERF_MAX_COUNTERS];
+	int perf_count = internal_mtr_perf_read(perf_end);
+	if (coalesce_event(category, name, 'X', id))
+		return;
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(perf_count, &args);
+	if (!ev)
+		return;
+	fill_event(ev, category, name, 'X', id);
+	perf_fill_deltas(args, ev->extra_arg_count, start_values, perf_end);
+	finish_event(ev);
 #else
-	ev->cat = category;
-	ev->name = name;
+	(void)start_values;
+	internal_mtr_raw_event(category, name, 'X', id);
 #endif
+}
 
-	ev->id = id;
-	ev->ts = (int64_t)(ts * 1000000);
-	ev->ph = ph;
-	ev->tid = cur_thread_id;
-	ev->pid = cur_process_id;
+static void set_event_arg(raw_event_t *ev, mtr_arg_type arg_type, const char *arg_name, void *arg_value) {
 	ev->arg_type = arg_type;
 	ev->arg_name = arg_name;
 	switch (arg_type) {
@@ -479,9 +2198,289 @@ void internal_mtr_raw_event_arg(const char *category, const char *name, char ph,
 	case MTR_ARG_TYPE_STRING_COPY: ev->a_str = strdup((const char*)arg_value); break;
 	case MTR_ARG_TYPE_NONE: break;
 	}
+}
 
-	pthread_mutex_lock(&event_mutex);
-	--events_in_progress;
-	pthread_mutex_unlock(&event_mutex);
+void internal_mtr_raw_event_arg(const char *category, const char *name, char ph, void *id, mtr_arg_type arg_type, const char *arg_name, void *arg_value) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	int64_t perf_end[MTR_PERF_MAX_COUNTERS];
+	const int64_t *perf_start = NULL;
+	int perf_count = scope_counters(ph, perf_end, &perf_start);
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(perf_count, &args);
+	if (!ev)
+		return;
+	fill_event(ev, category, name, ph, id);
+	set_event_arg(ev, arg_type, arg_name, arg_value);
+#ifdef MTR_PERF_COUNTERS
+	perf_fill_deltas(args, ev->extra_arg_count, perf_start, perf_end);
+#endif
+	finish_event(ev);
 }
 
+void internal_mtr_raw_event_id(const char *category, const char *name, char ph, uint64_t id, mtr_arg_type arg_type, const char *arg_name, void *arg_value) {
+#ifndef MTR_ENABLED
+	return;
+#endif
+	raw_arg_t *args;
+	raw_event_t *ev = begin_event(0, &args);
+	if (!ev)
+		return;
+	fill_event(ev, category, name, ph, 0);
+	ev->id = id;
+	set_event_arg(ev, arg_type, arg_name, arg_value);
+	finish_event(ev);
+}
+
+uint64_t mtr_async_id() {
+	static volatile uint64_t next_async_id = 0;
+#ifdef _WIN32
+	return (uint64_t)InterlockedIncrement64((volatile LONG64 *)&next_async_id);
+#else
+	return __atomic_add_fetch(&next_async_id, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Traced locks.
+// The registry of live mutexes is needed before mtr_init and after mtr_shutdown,
+// so it has its own statically initialized lock.
+static static_mutex_t lock_registry_mutex = STATIC_MUTEX_INIT;
+static mtr_mutex_t *lock_registry_head;
+static double lock_threshold_s = 0.00001;
+
+void mtr_set_lock_threshold_us(int threshold_us) {
+	lock_threshold_s = threshold_us * 0.000001;
+}
+
+void mtr_mutex_init(mtr_mutex_t *m, const char *name) {
+	memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+	InitializeSRWLock((PSRWLOCK)&m->lock);
+#else
+	pthread_mutex_init(&m->lock, 0);
+#endif
+	m->name = name;
+	static_mutex_lock(&lock_registry_mutex);
+	m->next = lock_registry_head;
+	if (lock_registry_head)
+		lock_registry_head->prev = m;
+	lock_registry_head = m;
+	static_mutex_unlock(&lock_registry_mutex);
+}
+
+void mtr_mutex_destroy(mtr_mutex_t *m) {
+	static_mutex_lock(&lock_registry_mutex);
+	if (m->prev)
+		m->prev->next = m->next;
+	else
+		lock_registry_head = m->next;
+	if (m->next)
+		m->next->prev = m->prev;
+	static_mutex_unlock(&lock_registry_mutex);
+#ifndef _WIN32
+	pthread_mutex_destroy(&m->lock);
+#endif
+}
+
+// Called with m held.
+static void lock_acquired(mtr_mutex_t *m, double wait_start, double now) {
+	m->acquisitions++;
+	m->acquire_time = now;
+	if (wait_start >= 0.0) {
+		uint64_t wait_us = (uint64_t)((now - wait_start) * 1000000);
+		m->contentions++;
+		m->wait_us += wait_us;
+		if (wait_us > m->max_wait_us)
+			m->max_wait_us = wait_us;
+		if (now - wait_start >= lock_threshold_s) {
+			internal_mtr_raw_event_arg("lock", m->name, 'X', &wait_start, MTR_ARG_TYPE_STRING_CONST, "phase", (void *)"wait");
+		}
+	}
+}
+
+// Called with m held, right before releasing it. Returns the acquire time if the
+// hold should be traced once the lock is released, or a negative value otherwise.
+static double lock_releasing(mtr_mutex_t *m) {
+	double hold = mtr_time_s() - m->acquire_time;
+	m->hold_us += (uint64_t)(hold * 1000000);
+	return hold >= lock_threshold_s ? m->acquire_time : -1.0;
+}
+
+static void lock_released(mtr_mutex_t *m, double acquire_time) {
+	if (acquire_time >= 0.0) {
+		internal_mtr_raw_event_arg("lock", m->name, 'X', &acquire_time, MTR_ARG_TYPE_STRING_CONST, "phase", (void *)"hold");
+	}
+}
+
+void mtr_mutex_lock(mtr_mutex_t *m) {
+	double wait_start = -1.0;
+#ifdef _WIN32
+	if (!TryAcquireSRWLockExclusive((PSRWLOCK)&m->lock)) {
+		wait_start = mtr_time_s();
+		AcquireSRWLockExclusive((PSRWLOCK)&m->lock);
+	}
+#else
+	if (pthread_mutex_trylock(&m->lock) != 0) {
+		wait_start = mtr_time_s();
+		pthread_mutex_lock(&m->lock);
+	}
+#endif
+	lock_acquired(m, wait_start, mtr_time_s());
+}
+
+int mtr_mutex_trylock(mtr_mutex_t *m) {
+#ifdef _WIN32
+	if (!TryAcquireSRWLockExclusive((PSRWLOCK)&m->lock))
+		return FALSE;
+#else
+	if (pthread_mutex_trylock(&m->lock) != 0)
+		return FALSE;
+#endif
+	lock_acquired(m, -1.0, mtr_time_s());
+	return TRUE;
+}
+
+void mtr_mutex_unlock(mtr_mutex_t *m) {
+	double acquire_time = lock_releasing(m);
+#ifdef _WIN32
+	ReleaseSRWLockExclusive((PSRWLOCK)&m->lock);
+#else
+	pthread_mutex_unlock(&m->lock);
+#endif
+	lock_released(m, acquire_time);
+}
+
+void mtr_cond_init(mtr_cond_t *c) {
+#ifdef _WIN32
+	InitializeConditionVariable((PCONDITION_VARIABLE)&c->cond);
+#else
+	pthread_cond_init(&c->cond, 0);
+#endif
+}
+
+void mtr_cond_destroy(mtr_cond_t *c) {
+#ifdef _WIN32
+	(void)c;
+#else
+	pthread_cond_destroy(&c->cond);
+#endif
+}
+
+// Time spent blocked on the condition isn't contention, so it only shows up as a
+// "cond_wait" event. The hold before and after the wait are traced separately.
+void mtr_cond_wait(mtr_cond_t *c, mtr_mutex_t *m) {
+	double acquire_time = lock_releasing(m);
+	double wait_start = mtr_time_s();
+#ifdef _WIN32
+	SleepConditionVariableSRW((PCONDITION_VARIABLE)&c->cond, (PSRWLOCK)&m->lock, INFINITE, 0);
+#else
+	pthread_cond_wait(&c->cond, &m->lock);
+#endif
+	double now = mtr_time_s();
+	m->acquisitions++;
+	m->acquire_time = now;
+	lock_released(m, acquire_time);
+	if (now - wait_start >= lock_threshold_s) {
+		internal_mtr_raw_event_arg("lock", m->name, 'X', &wait_start, MTR_ARG_TYPE_STRING_CONST, "phase", (void *)"cond_wait");
+	}
+}
+
+void mtr_cond_signal(mtr_cond_t *c) {
+#ifdef _WIN32
+	WakeConditionVariable((PCONDITION_VARIABLE)&c->cond);
+#else
+	pthread_cond_signal(&c->cond);
+#endif
+}
+
+void mtr_cond_broadcast(mtr_cond_t *c) {
+#ifdef _WIN32
+	WakeAllConditionVariable((PCONDITION_VARIABLE)&c->cond);
+#else
+	pthread_cond_broadcast(&c->cond);
+#endif
+}
+
+// The counters are read without taking each lock, so a dump taken under heavy
+// contention may be slightly inconsistent.
+void mtr_dump_lock_stats(void *stream) {
+	FILE *out = (FILE *)stream;
+	mtr_mutex_t *m;
+	fprintf(out, "%-32s %12s %12s %14s %12s %14s\n", "lock", "acquisitions", "contentions", "wait_us", "max_wait_us", "hold_us");
+	static_mutex_lock(&lock_registry_mutex);
+	for (m = lock_registry_head; m; m = m->next) {
+		fprintf(out, "%-32s %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %14" PRIu64 "\n",
+				m->name, m->acquisitions, m->contentions, m->wait_us, m->max_wait_us, m->hold_us);
+	}
+	static_mutex_unlock(&lock_registry_mutex);
+}
+
+// Fork handling.
+// A child of a process attached to a shared buffer keeps tracing into it. Otherwise
+// the child stops tracing, since it can't share the parent's file, and may call
+// mtr_init with a file of its own.
+#ifndef _WIN32
+// The handlers stay registered after mtr_shutdown, when there is no mutex to take.
+static int fork_held_mutex;
+
+static void fork_prepare() {
+	fork_held_mutex = is_initialized;
+	if (!fork_held_mutex)
+		return;
+	pthread_mutex_lock(&mutex);
+	// Anything left in the stdio buffer would be written by both processes.
+	if (f)
+		fflush(f);
+}
+
+static void fork_parent() {
+	if (fork_held_mutex)
+		pthread_mutex_unlock(&mutex);
+}
+
+static void fork_child() {
+	if (fork_held_mutex) {
+		pthread_mutex_unlock(&mutex);
+		// Other threads may have held this, and they don't exist in the child.
+		pthread_mutex_init(&event_mutex, 0);
+	}
+	static_mutex_init(&lock_registry_mutex);
+	thread_registry_fork_child();
+	cur_process_id = 0;
+	cur_thread_id = 0;
+	perf_reset_thread();
+	sampler_fork_child();
+	percpu_free();
+
+	// The parent writes out whatever was buffered before the fork.
+	free(event_buffer);
+	event_buffer = 0;
+	free(flush_buffer);
+	flush_buffer = 0;
+	free(arg_buffer);
+	arg_buffer = 0;
+	free(flush_arg_buffer);
+	flush_arg_buffer = 0;
+	event_count = 0;
+	arg_count = 0;
+	events_in_progress = 0;
+	is_flushing = FALSE;
+	f = 0;
+	if (shm) {
+		shm_is_owner = FALSE;
+	} else {
+		is_tracing = FALSE;
+	}
+}
+
+static void register_fork_handlers() {
+	static int registered = FALSE;
+	if (!registered) {
+		pthread_atfork(&fork_prepare, &fork_parent, &fork_child);
+		registered = TRUE;
+	}
+}
+#else
+static void register_fork_handlers() {}
+#endif
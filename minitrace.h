@@ -22,6 +22,9 @@
 #define MINITRACE_H
 
 #include <inttypes.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #ifdef MTR_BUILDING_WITH_CMAKE
 #include "minitrace_export.h"
@@ -38,6 +41,32 @@
 // occasionally. It's safe...ish.
 #define INTERNAL_MINITRACE_BUFFER_SIZE 1000000
 
+// Size of the ring used by mtr_init_shared. Events in it carry their strings
+// inline, so they are much bigger than regular ones.
+#define INTERNAL_MINITRACE_SHM_BUFFER_SIZE 65536
+
+// Size of each per-CPU buffer used by mtr_init_percpu. There are two per CPU
+// that has traced anything.
+#define INTERNAL_MINITRACE_PERCPU_BUFFER_SIZE 32768
+
+// If MTR_PERF_COUNTERS is defined (Linux only), scopes also record per-thread
+// counter deltas as event arguments. This covers MTR_SCOPE and MTR_BEGIN/MTR_END
+// pairs on the same thread. Hardware counters (instructions, cycles, cache and
+// branch misses) are used when the PMU is accessible, otherwise software counters
+// (task clock, page faults, context switches). If libminitrace_malloc is loaded,
+// the number and bytes of allocations are added. Must be set the same way for
+// minitrace.c and all code including this header.
+// #define MTR_PERF_COUNTERS
+#define MTR_PERF_MAX_COUNTERS 6
+
+// Room for extra integer arguments, such as performance counter deltas. Events
+// that don't fit get none. With counters, every event can carry all of them.
+#ifdef MTR_PERF_COUNTERS
+#define INTERNAL_MINITRACE_ARG_BUFFER_SIZE (INTERNAL_MINITRACE_BUFFER_SIZE * MTR_PERF_MAX_COUNTERS)
+#else
+#define INTERNAL_MINITRACE_ARG_BUFFER_SIZE (INTERNAL_MINITRACE_BUFFER_SIZE / 4)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,6 +79,44 @@ MINITRACE_EXPORT void mtr_init(const char *json_file);
 // processing of line endings (i.e. the "wb" mode).
 MINITRACE_EXPORT void mtr_init_from_stream(void *stream);
 
+// Thread metadata, used by MTR_META_THREAD_NAME and MTR_META_THREAD_SORT_INDEX.
+// Stored once per thread (the name is copied) and written once per output file,
+// instead of being buffered as events. Threads are identified by their kernel
+// thread ids where available, matching perf and top.
+MINITRACE_EXPORT void mtr_set_thread_name(const char *name);
+MINITRACE_EXPORT void mtr_set_thread_sort_index(int sort_index);
+
+// Multi-process tracing (not on Windows). Like mtr_init, but events go through a
+// ring in shared memory named shm_name (as for shm_open, e.g. "/myapp_trace").
+// Other processes on the host can add to it with mtr_attach_shared, and children
+// forked after this call are attached automatically. Pass NULL as shm_name if
+// only forked children need to attach. Only this process writes json_file, when
+// it flushes, so all processes end up in one time-aligned trace. Its own events
+// stay in its local buffer. Strings are copied into the ring and truncated if
+// long. Events from other processes that find the ring full are dropped, and the
+// number dropped appears in the trace as minitrace/dropped_events.
+MINITRACE_EXPORT void mtr_init_shared(const char *json_file, const char *shm_name);
+// Use instead of mtr_init in the other processes. Returns 0 on failure.
+// mtr_shutdown detaches again.
+MINITRACE_EXPORT int mtr_attach_shared(const char *shm_name);
+
+// Like mtr_init, but events go to a buffer per CPU instead of one global buffer
+// behind a lock, using restartable sequences (Linux x86-64, glibc 2.35+). Meant
+// for programs with many threads, where the global lock is contended. Returns 0
+// if rseq isn't available, in which case the global buffer is used. Otherwise the
+// global buffer isn't allocated at all.
+MINITRACE_EXPORT int mtr_init_percpu(const char *json_file);
+
+// Merges runs of short, identical scopes, such as those in a tight loop. Consecutive
+// scopes on a thread with the same category and name (MTR_SCOPE, MTR_BEGIN/MTR_END
+// without arguments), each shorter than max_dur_us and at most max_gap_us apart,
+// are written as one X event with count, total_dur and max_dur arguments. A run is
+// written when its thread records anything else or exits, and by any thread's
+// mtr_flush, mtr_stop or mtr_shutdown. Per-scope counter deltas of merged scopes
+// are dropped. Pass 0 as max_dur_us to turn it off,
+// which is the default.
+MINITRACE_EXPORT void mtr_set_coalescing_us(int max_dur_us, int max_gap_us);
+
 // Shuts down minitrace cleanly, flushing the trace buffer.
 MINITRACE_EXPORT void mtr_shutdown(void);
 
@@ -62,6 +129,9 @@ MINITRACE_EXPORT void mtr_stop(void);
 // Flushes the collected data to disk, clearing the buffer for new data.
 MINITRACE_EXPORT void mtr_flush(void);
 
+// Returns a new id for async events, unique within the process.
+MINITRACE_EXPORT uint64_t mtr_async_id(void);
+
 // Returns the current time in seconds. Used internally by Minitrace. No caching.
 MINITRACE_EXPORT double mtr_time_s(void);
 
@@ -75,6 +145,69 @@ MINITRACE_EXPORT void mtr_register_sigint_handler(void);
 // Returns a fixed string if the pool is full.
 MINITRACE_EXPORT const char *mtr_pool_string(const char *str);
 
+// Traced locks. Drop-in replacements for a mutex and condition variable that
+// record how long threads waited for the lock and how long they held it, as X events
+// in the "lock" category named after the lock. Waits and holds shorter than the
+// threshold (10 us by default) are not traced. They still count towards the
+// per-lock statistics, which are kept even when not tracing.
+typedef struct mtr_mutex {
+#ifdef _WIN32
+	void *lock;	// SRWLOCK
+#else
+	pthread_mutex_t lock;
+#endif
+	const char *name;
+	double acquire_time;
+	// Updated while holding the lock.
+	uint64_t acquisitions;
+	uint64_t contentions;
+	uint64_t wait_us;
+	uint64_t max_wait_us;
+	uint64_t hold_us;
+	struct mtr_mutex *prev;
+	struct mtr_mutex *next;
+} mtr_mutex_t;
+
+typedef struct mtr_cond {
+#ifdef _WIN32
+	void *cond;	// CONDITION_VARIABLE
+#else
+	pthread_cond_t cond;
+#endif
+} mtr_cond_t;
+
+// name must be a const string that outlives the mutex.
+MINITRACE_EXPORT void mtr_mutex_init(mtr_mutex_t *m, const char *name);
+MINITRACE_EXPORT void mtr_mutex_destroy(mtr_mutex_t *m);
+MINITRACE_EXPORT void mtr_mutex_lock(mtr_mutex_t *m);
+// Returns non-zero if the lock was acquired.
+MINITRACE_EXPORT int mtr_mutex_trylock(mtr_mutex_t *m);
+MINITRACE_EXPORT void mtr_mutex_unlock(mtr_mutex_t *m);
+
+MINITRACE_EXPORT void mtr_cond_init(mtr_cond_t *c);
+MINITRACE_EXPORT void mtr_cond_destroy(mtr_cond_t *c);
+MINITRACE_EXPORT void mtr_cond_wait(mtr_cond_t *c, mtr_mutex_t *m);
+MINITRACE_EXPORT void mtr_cond_signal(mtr_cond_t *c);
+MINITRACE_EXPORT void mtr_cond_broadcast(mtr_cond_t *c);
+
+MINITRACE_EXPORT void mtr_set_lock_threshold_us(int threshold_us);
+// Writes a table of per-lock contention counters to stream (a FILE *), such as stdout.
+// Doesn't need mtr_init.
+MINITRACE_EXPORT void mtr_dump_lock_stats(void *stream);
+
+// Sampling profiler (Linux only). Samples the call stacks of registered threads
+// hz times per second of CPU time they use, and writes them out as P events
+// on flush, so hotspots show up inside large scopes in the same timeline.
+// Stacks are walked with frame pointers, so build with -fno-omit-frame-pointer.
+// mtr_sampler_start registers the calling thread. Other threads must call
+// mtr_sampler_register_thread themselves. They are unregistered when they exit.
+// Processes attached with mtr_attach_shared discard their samples on flush, since
+// only the owner of the ring writes a file.
+MINITRACE_EXPORT void mtr_sampler_start(int hz);
+MINITRACE_EXPORT void mtr_sampler_stop(void);
+MINITRACE_EXPORT void mtr_sampler_register_thread(void);
+MINITRACE_EXPORT void mtr_sampler_unregister_thread(void);
+
 // Commented-out types will be supported in the future.
 typedef enum {
 	MTR_ARG_TYPE_NONE = 0,
@@ -93,6 +226,11 @@ typedef enum {
 // Only use the macros to call these.
 MINITRACE_EXPORT void internal_mtr_raw_event(const char *category, const char *name, char ph, void *id);
 MINITRACE_EXPORT void internal_mtr_raw_event_arg(const char *category, const char *name, char ph, void *id, mtr_arg_type arg_type, const char *arg_name, void *arg_value);
+// Reads the calling thread's counters into values, returning how many were read.
+MINITRACE_EXPORT int internal_mtr_perf_read(int64_t *values);
+MINITRACE_EXPORT void internal_mtr_raw_event_id(const char *category, const char *name, char ph, uint64_t id, mtr_arg_type arg_type, const char *arg_name, void *arg_value);
+// Emits an X event, attaching the counter deltas since start_values.
+MINITRACE_EXPORT void internal_mtr_raw_event_perf(const char *category, const char *name, void *id, const int64_t *start_values);
 
 #ifdef MTR_ENABLED
 
@@ -110,6 +248,20 @@ MINITRACE_EXPORT void internal_mtr_raw_event_arg(const char *category, const cha
 #define MTR_START(c, n, id) internal_mtr_raw_event(c, n, 'S', (void *)(id))
 #define MTR_STEP(c, n, id, step) internal_mtr_raw_event_arg(c, n, 'T', (void *)(id), MTR_ARG_TYPE_STRING_CONST, "step", (void *)(step))
 #define MTR_FINISH(c, n, id) internal_mtr_raw_event(c, n, 'F', (void *)(id))
+// Use this instead of MTR_STEP when the step would have to be built dynamically.
+#define MTR_STEP_I(c, n, id, step) internal_mtr_raw_event_arg(c, n, 'T', (void *)(id), MTR_ARG_TYPE_INT, "step", (void *)(intptr_t)(step))
+
+// Nestable async events. Slices with the same category and id share a track and
+// nest by time, so a task can be broken down into sub-slices. The id is a 64-bit
+// integer (see mtr_async_id), cast pointers through uintptr_t.
+// In C++, MTRAsyncScope is more convenient.
+#define MTR_ASYNC_BEGIN(c, n, id) internal_mtr_raw_event_id(c, n, 'b', (uint64_t)(id), MTR_ARG_TYPE_NONE, 0, 0)
+#define MTR_ASYNC_END(c, n, id) internal_mtr_raw_event_id(c, n, 'e', (uint64_t)(id), MTR_ARG_TYPE_NONE, 0, 0)
+#define MTR_ASYNC_INSTANT(c, n, id) internal_mtr_raw_event_id(c, n, 'n', (uint64_t)(id), MTR_ARG_TYPE_NONE, 0, 0)
+#define MTR_ASYNC_BEGIN_C(c, n, id, aname, astrval) internal_mtr_raw_event_id(c, n, 'b', (uint64_t)(id), MTR_ARG_TYPE_STRING_CONST, aname, (void *)(astrval))
+#define MTR_ASYNC_BEGIN_I(c, n, id, aname, aintval) internal_mtr_raw_event_id(c, n, 'b', (uint64_t)(id), MTR_ARG_TYPE_INT, aname, (void *)(intptr_t)(aintval))
+#define MTR_ASYNC_INSTANT_C(c, n, id, aname, astrval) internal_mtr_raw_event_id(c, n, 'n', (uint64_t)(id), MTR_ARG_TYPE_STRING_CONST, aname, (void *)(astrval))
+#define MTR_ASYNC_INSTANT_I(c, n, id, aname, aintval) internal_mtr_raw_event_id(c, n, 'n', (uint64_t)(id), MTR_ARG_TYPE_INT, aname, (void *)(intptr_t)(aintval))
 
 // Flow events. Like async events, but displayed in a more fancy way in the viewer.
 #define MTR_FLOW_START(c, n, id) internal_mtr_raw_event(c, n, 's', (void *)(id))
@@ -146,8 +298,8 @@ MINITRACE_EXPORT void internal_mtr_raw_event_arg(const char *category, const cha
 // Metadata. Call at the start preferably. Must be const strings.
 
 #define MTR_META_PROCESS_NAME(n) internal_mtr_raw_event_arg("", "process_name", 'M', 0, MTR_ARG_TYPE_STRING_COPY, "name", (void *)(n))
-#define MTR_META_THREAD_NAME(n) internal_mtr_raw_event_arg("", "thread_name", 'M', 0, MTR_ARG_TYPE_STRING_COPY, "name", (void *)(n))
-#define MTR_META_THREAD_SORT_INDEX(i) internal_mtr_raw_event_arg("", "thread_sort_index", 'M', 0, MTR_ARG_TYPE_INT, "sort_index", (void *)(i))
+#define MTR_META_THREAD_NAME(n) mtr_set_thread_name(n)
+#define MTR_META_THREAD_SORT_INDEX(i) mtr_set_thread_sort_index(i)
 
 #else
 
@@ -157,6 +309,14 @@ MINITRACE_EXPORT void internal_mtr_raw_event_arg(const char *category, const cha
 #define MTR_START(c, n, id)
 #define MTR_STEP(c, n, id, step)
 #define MTR_FINISH(c, n, id)
+#define MTR_STEP_I(c, n, id, step)
+#define MTR_ASYNC_BEGIN(c, n, id)
+#define MTR_ASYNC_END(c, n, id)
+#define MTR_ASYNC_INSTANT(c, n, id)
+#define MTR_ASYNC_BEGIN_C(c, n, id, aname, astrval)
+#define MTR_ASYNC_BEGIN_I(c, n, id, aname, aintval)
+#define MTR_ASYNC_INSTANT_C(c, n, id, aname, astrval)
+#define MTR_ASYNC_INSTANT_I(c, n, id, aname, aintval)
 #define MTR_FLOW_START(c, n, id)
 #define MTR_FLOW_STEP(c, n, id, step)
 #define MTR_FLOW_FINISH(c, n, id)
@@ -222,15 +382,25 @@ public:
 	MTRScopedTrace(const char *category, const char *name)
 		: category_(category), name_(name) {
 		start_time_ = mtr_time_s();
+#ifdef MTR_PERF_COUNTERS
+		internal_mtr_perf_read(perf_start_);
+#endif
 	}
 	~MTRScopedTrace() {
+#ifdef MTR_PERF_COUNTERS
+		internal_mtr_raw_event_perf(category_, name_, &start_time_, perf_start_);
+#else
 		internal_mtr_raw_event(category_, name_, 'X', &start_time_);
+#endif
 	}
 
 private:
 	const char *category_;
 	const char *name_;
 	double start_time_;
+#ifdef MTR_PERF_COUNTERS
+	int64_t perf_start_[MTR_PERF_MAX_COUNTERS];
+#endif
 };
 
 // Only outputs a block if execution time exceeded the limit.
@@ -271,6 +441,109 @@ private:
 };
 #endif
 
+// Traces an async task, such as a coroutine, as a nestable async slice from
+// construction to destruction. It has no ties to the thread that created it, so it
+// can live in a coroutine frame and be carried across co_await and thread hops.
+// Sub-slices share the parent's track. Nothing is allocated, so keep names and
+// step strings constant, and use the int variant of step for dynamic values.
+// Does nothing when MTR_ENABLED isn't defined.
+class MTRAsyncScope {
+public:
+	MTRAsyncScope(const char *category, const char *name)
+		: category_(category), name_(name), id_(mtr_async_id()) {
+		begin();
+	}
+	MTRAsyncScope(const char *category, const char *name, uint64_t id)
+		: category_(category), name_(name), id_(id) {
+		begin();
+	}
+	// A sub-slice of parent, which must outlive it.
+	MTRAsyncScope(const MTRAsyncScope &parent, const char *name)
+		: category_(parent.category_), name_(name), id_(parent.id_) {
+		begin();
+	}
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+	MTRAsyncScope(MTRAsyncScope &&other)
+		: category_(other.category_), name_(other.name_), id_(other.id_) {
+		other.name_ = 0;
+	}
+#endif
+	~MTRAsyncScope() {
+		end();
+	}
+
+	// Ends the slice early.
+	void end() {
+#ifdef MTR_ENABLED
+		if (name_)
+			internal_mtr_raw_event_id(category_, name_, 'e', id_, MTR_ARG_TYPE_NONE, 0, 0);
+#endif
+		name_ = 0;
+	}
+	// Marks a point in time on the task's track.
+	void step(const char *step_name) {
+#ifdef MTR_ENABLED
+		internal_mtr_raw_event_id(category_, step_name, 'n', id_, MTR_ARG_TYPE_NONE, 0, 0);
+#else
+		(void)step_name;
+#endif
+	}
+	void step(const char *step_name, const char *arg_name, int value) {
+#ifdef MTR_ENABLED
+		internal_mtr_raw_event_id(category_, step_name, 'n', id_, MTR_ARG_TYPE_INT, arg_name, (void *)(intptr_t)value);
+#else
+		(void)step_name; (void)arg_name; (void)value;
+#endif
+	}
+	uint64_t id() const {
+		return id_;
+	}
+
+private:
+	MTRAsyncScope(const MTRAsyncScope &);
+	MTRAsyncScope &operator=(const MTRAsyncScope &);
+
+	void begin() {
+#ifdef MTR_ENABLED
+		internal_mtr_raw_event_id(category_, name_, 'b', id_, MTR_ARG_TYPE_NONE, 0, 0);
+#endif
+	}
+
+	const char *category_;
+	const char *name_;
+	uint64_t id_;
+};
+
+// Usable with std::lock_guard, std::unique_lock and std::condition_variable_any.
+// Works as a plain mutex when tracing is disabled.
+class MTRTracedMutex {
+public:
+	explicit MTRTracedMutex(const char *name) {
+		mtr_mutex_init(&mutex_, name);
+	}
+	~MTRTracedMutex() {
+		mtr_mutex_destroy(&mutex_);
+	}
+	void lock() {
+		mtr_mutex_lock(&mutex_);
+	}
+	bool try_lock() {
+		return mtr_mutex_trylock(&mutex_) != 0;
+	}
+	void unlock() {
+		mtr_mutex_unlock(&mutex_);
+	}
+	mtr_mutex_t *native_handle() {
+		return &mutex_;
+	}
+
+private:
+	MTRTracedMutex(const MTRTracedMutex &);
+	MTRTracedMutex &operator=(const MTRTracedMutex &);
+
+	mtr_mutex_t mutex_;
+};
+
 #endif
 
 #endif
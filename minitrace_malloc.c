@@ -0,0 +1,259 @@
+// minitrace_malloc
+// Copyright 2014 by Henrik Rydgård
+// http://www.github.com/hrydgard/minitrace
+// Released under the MIT license.
+
+// Heap tracing for minitrace (Linux only). Wraps the malloc family, either
+// preloaded (LD_PRELOAD=libminitrace_malloc.so) or linked into the program, and
+// counts allocations and bytes per thread. mtr_init looks for it with dlsym and
+// attaches. From then on it emits a "heap" counter with the live heap size at most
+// every MTR_MALLOC_INTERVAL_MS milliseconds (default 10), and a "large_alloc"
+// instant event for allocations of at least MTR_MALLOC_LARGE bytes (default 1 MB,
+// 0 turns them off). If minitrace is built with MTR_PERF_COUNTERS, scopes also get
+// the number and bytes of allocations made on their thread as arguments.
+//
+// operator new and delete aren't wrapped separately, since the C++ runtime
+// implements them with malloc and free.
+//
+// Nothing here allocates. Sizes are the usable sizes reported by the underlying
+// allocator. Events are never emitted from inside another event, so allocations
+// made by minitrace itself are counted but can't recurse.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	// RTLD_NEXT
+#endif
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Initial-exec, so that accessing it never allocates.
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+#define BOOTSTRAP_SIZE 65536
+#define LIVE_BYTES_BATCH 65536	// Per-thread slack before updating the shared total.
+#define ALLOCS_PER_CLOCK_CHECK 256
+
+// Must match the declarations in minitrace.c.
+typedef void (*mtr_malloc_emit_t)(const char *name, char ph, const char *arg_name, int64_t value);
+
+typedef struct thread_stats {
+	int64_t allocs;
+	int64_t alloc_bytes;
+	int64_t pending_live_bytes;	// Not yet added to live_bytes.
+	int until_clock_check;
+	int in_emit;
+} thread_stats_t;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static size_t (*real_malloc_usable_size)(void *);
+
+static mtr_malloc_emit_t emit_fn;
+static int64_t live_bytes;
+static int64_t next_counter_ns;
+static int64_t counter_interval_ns = 10000000;
+static size_t large_alloc_bytes = 1 << 20;
+static TLS thread_stats_t stats;
+
+// dlsym allocates before the real functions are known. Blocks from here are
+// never reused, so they are also zeroed as calloc requires.
+static char bootstrap_arena[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int resolving;
+
+static void *bootstrap_alloc(size_t size) {
+	size_t rounded = (size + 15) & ~(size_t)15;
+	size_t offset;
+	if (rounded < size || rounded > BOOTSTRAP_SIZE)
+		return NULL;
+	offset = __atomic_fetch_add(&bootstrap_used, 16 + rounded, __ATOMIC_RELAXED);
+	if (offset + 16 + rounded > BOOTSTRAP_SIZE)
+		return NULL;
+	*(size_t *)(bootstrap_arena + offset) = size;
+	return bootstrap_arena + offset + 16;
+}
+
+static int is_bootstrap(void *p) {
+	return (char *)p >= bootstrap_arena && (char *)p < bootstrap_arena + BOOTSTRAP_SIZE;
+}
+
+static void resolve() {
+	resolving = 1;
+	real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+	real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+	real_posix_memalign = (int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+	real_memalign = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+	real_malloc_usable_size = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+	resolving = 0;
+}
+
+__attribute__((constructor))
+static void init() {
+	if (!real_malloc)
+		resolve();
+}
+
+static void emit(const char *name, char ph, const char *arg_name, int64_t value) {
+	mtr_malloc_emit_t fn = __atomic_load_n(&emit_fn, __ATOMIC_ACQUIRE);
+	if (!fn || stats.in_emit)
+		return;
+	stats.in_emit = 1;
+	fn(name, ph, arg_name, value);
+	stats.in_emit = 0;
+}
+
+static void add_live_bytes(int64_t delta) {
+	stats.pending_live_bytes += delta;
+	if (stats.pending_live_bytes >= LIVE_BYTES_BATCH || stats.pending_live_bytes <= -LIVE_BYTES_BATCH) {
+		__atomic_add_fetch(&live_bytes, stats.pending_live_bytes, __ATOMIC_RELAXED);
+		stats.pending_live_bytes = 0;
+	}
+}
+
+// Only called for allocations, since callers are less likely to hold locks that
+// minitrace needs than when freeing, for example from a thread exit destructor.
+static void on_alloc(void *p) {
+	size_t size = real_malloc_usable_size(p);
+	stats.allocs++;
+	stats.alloc_bytes += size;
+	add_live_bytes((int64_t)size);
+	if (large_alloc_bytes && size >= large_alloc_bytes) {
+		emit("large_alloc", 'I', "bytes", (int64_t)size);
+	}
+	if (stats.until_clock_check-- > 0)
+		return;
+	stats.until_clock_check = ALLOCS_PER_CLOCK_CHECK;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	int64_t next = __atomic_load_n(&next_counter_ns, __ATOMIC_RELAXED);
+	if (now < next || !__atomic_compare_exchange_n(&next_counter_ns, &next, now + counter_interval_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	emit("heap", 'C', "live_kb", __atomic_load_n(&live_bytes, __ATOMIC_RELAXED) / 1024);
+}
+
+static void on_free(void *p) {
+	add_live_bytes(-(int64_t)real_malloc_usable_size(p));
+}
+
+// Called by mtr_init with the function to emit events with, and by mtr_shutdown with NULL.
+// Settings are read here rather than in init, since other constructors allocate
+// before it runs, and the first counter comes right away.
+void mtr_malloc_attach(mtr_malloc_emit_t emit) {
+	const char *env;
+	if (emit) {
+		if ((env = getenv("MTR_MALLOC_INTERVAL_MS")) != NULL)
+			counter_interval_ns = strtoll(env, NULL, 10) * 1000000;
+		if ((env = getenv("MTR_MALLOC_LARGE")) != NULL)
+			large_alloc_bytes = (size_t)strtoull(env, NULL, 10);
+		__atomic_store_n(&next_counter_ns, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&emit_fn, emit, __ATOMIC_RELEASE);
+}
+
+// Writes the number of allocations and bytes allocated so far on the calling thread.
+int mtr_malloc_thread_stats(int64_t *values) {
+	values[0] = stats.allocs;
+	values[1] = stats.alloc_bytes;
+	return 2;
+}
+
+void *malloc(size_t size) {
+	void *p;
+	if (!real_malloc) {
+		if (resolving)
+			return bootstrap_alloc(size);
+		resolve();
+	}
+	p = real_malloc(size);
+	if (p)
+		on_alloc(p);
+	return p;
+}
+
+void free(void *p) {
+	if (!p || is_bootstrap(p))
+		return;
+	if (!real_free)
+		resolve();
+	on_free(p);
+	real_free(p);
+}
+
+void *calloc(size_t n, size_t size) {
+	void *p;
+	if (!real_calloc) {
+		if (resolving)
+			return size && n > (size_t)-1 / size ? NULL : bootstrap_alloc(n * size);
+		resolve();
+	}
+	p = real_calloc(n, size);
+	if (p)
+		on_alloc(p);
+	return p;
+}
+
+void *realloc(void *p, size_t size) {
+	size_t old_size;
+	void *q;
+	if (p && is_bootstrap(p)) {
+		old_size = *(size_t *)((char *)p - 16);
+		q = malloc(size);
+		if (q)
+			memcpy(q, p, old_size < size ? old_size : size);
+		return q;
+	}
+	if (!real_realloc)
+		resolve();
+	old_size = p ? real_malloc_usable_size(p) : 0;
+	q = real_realloc(p, size);
+	if (q) {
+		add_live_bytes(-(int64_t)old_size);
+		on_alloc(q);
+	} else if (p && size == 0) {
+		add_live_bytes(-(int64_t)old_size);
+	}
+	return q;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+	int ret;
+	if (!real_posix_memalign)
+		resolve();
+	ret = real_posix_memalign(out, alignment, size);
+	if (ret == 0 && *out)
+		on_alloc(*out);
+	return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	void *p;
+	if (!real_aligned_alloc)
+		resolve();
+	p = real_aligned_alloc(alignment, size);
+	if (p)
+		on_alloc(p);
+	return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+	void *p;
+	if (!real_memalign)
+		resolve();
+	p = real_memalign(alignment, size);
+	if (p)
+		on_alloc(p);
+	return p;
+}
@@ -58,6 +58,18 @@ int main() {
 	usleep(10000);
 	a();
 
+	{
+		MTRAsyncScope request("background", "request");
+		usleep(10000);
+		{
+			MTRAsyncScope parse(request, "parse");
+			usleep(20000);
+		}
+		request.step("parsed", "bytes", 1234);
+		MTRAsyncScope respond(request, "respond");
+		usleep(20000);
+	}
+
 	usleep(50000);
 	MTR_INSTANT("main", "the end");
 	usleep(10000);
@@ -8,6 +8,9 @@
 
 #include "minitrace.h"
 
+MTRTracedMutex total_mutex("total");
+int total;
+
 // Does some meaningless work.
 int work(int cycles) {
 	int a = cycles;
@@ -22,12 +25,17 @@ void *worker_thread(void *param) {
 	int id = (int)(intptr_t)param;
 	char temp[256]; sprintf(temp, "Worker Thread %i", id);
 	MTR_META_THREAD_NAME(temp);
+	mtr_sampler_register_thread();
 	int x = 0;
 	for (int i = 0; i < 32; i++) {
 		MTR_BEGIN_I(__FILE__, "Worker", "ID", id);
 		x += work((rand() & 0x7fff) * 1000);
 		MTR_END(__FILE__, "Worker");
+		total_mutex.lock();
+		total += work(100000);
+		total_mutex.unlock();
 	}
+	mtr_sampler_unregister_thread();
 	return (void *)(intptr_t)x;
 }
 
@@ -43,6 +51,7 @@ int main() {
 	mtr_init("mt_trace.json");
 	MTR_META_PROCESS_NAME("Multithreaded Test");
 	MTR_META_THREAD_NAME("Main Thread");
+	mtr_sampler_start(1000);
 	MTR_BEGIN_FUNC();
 	#define NUMT 8
 	pthread_t threads[NUMT];
@@ -52,9 +61,12 @@ int main() {
 	for (i = 0; i < NUMT; i++) {
 		pthread_join(threads[i], 0);
 	}
+	// Writes phase2's 10000 tiny scopes as a single event.
+	mtr_set_coalescing_us(100, 100);
 	phase2();
 
 	MTR_END_FUNC();
 	mtr_shutdown();
+	mtr_dump_lock_stats(stdout);
 	return 0;
 }
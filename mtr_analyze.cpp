@@ -0,0 +1,834 @@
+// mtr_analyze - offline analyzer for minitrace output
+// Copyright 2014 by Henrik Rydgård
+// http://www.github.com/hrydgard/minitrace
+// Released under the MIT license.
+//
+// Reads a trace without building a DOM, so it copes with files far bigger than
+// what about:tracing can load. Reports, per event name: count, total time, self
+// time (minus time spent in nested slices on the same thread or async track) and
+// latency percentiles. Also reports the slowest individual slices and the longest
+// flow/async chains (s/t/f, S/T/F and b/e/n events sharing an id), along with the
+// step that took the longest in each.
+//
+// The file is processed in windows of a few chunks. Chunks are tokenized in
+// parallel, then analyzed in file order, so memory use doesn't grow with file size.
+// Minitrace writes one event per line, which is what makes it cheap to split the
+// file. Other traces work as long as no event object spans several lines.
+//
+// Usage: mtr_analyze [-n top_n] [-j threads] [-s total|self|count] trace.json
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+const size_t kChunkSize = 16 << 20;
+const size_t kMaxWindow = 256 << 20;
+const size_t kMaxPending = 4096;	// Completed slices per track that may still get a parent.
+const size_t kMaxChainSteps = 1024;
+
+// A string inside the current window. Only valid until the next window is read.
+struct StrRef {
+	const char *p;
+	uint32_t len;
+	bool operator==(const StrRef &o) const {
+		return len == o.len && memcmp(p, o.p, len) == 0;
+	}
+};
+
+struct StrRefHash {
+	size_t operator()(const StrRef &s) const {
+		// FNV-1a
+		uint64_t h = 14695981039346656037ULL;
+		for (uint32_t i = 0; i < s.len; i++) {
+			h = (h ^ (uint8_t)s.p[i]) * 1099511628211ULL;
+		}
+		return (size_t)h;
+	}
+};
+
+struct Event {
+	double ts;
+	double dur;
+	uint64_t id;
+	uint32_t pid;
+	uint32_t tid;
+	uint32_t name;	// Index into the chunk's string table until remapped.
+	uint32_t cat;
+	char ph;
+};
+
+struct Chunk {
+	const char *begin;
+	const char *end;
+	std::vector<Event> events;
+	std::vector<StrRef> strings;
+	size_t malformed;
+};
+
+// JSON tokenizer. Just enough to pull the interesting fields out of an event
+// object and skip everything else.
+
+inline const char *SkipWs(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+// p points at the opening quote. Escapes are left as is.
+const char *ParseString(const char *p, const char *end, StrRef *out) {
+	const char *start = ++p;
+	while (p < end && *p != '"') {
+		if (*p == '\\')
+			p++;
+		p++;
+	}
+	if (p >= end)
+		return 0;
+	if (out) {
+		out->p = start;
+		out->len = (uint32_t)(p - start);
+	}
+	return p + 1;
+}
+
+const char *SkipValue(const char *p, const char *end) {
+	if (p >= end)
+		return 0;
+	if (*p == '"')
+		return ParseString(p, end, 0);
+	if (*p == '{' || *p == '[') {
+		int depth = 0;
+		while (p < end) {
+			char c = *p;
+			if (c == '"') {
+				p = ParseString(p, end, 0);
+				if (!p)
+					return 0;
+				continue;
+			}
+			if (c == '{' || c == '[') {
+				depth++;
+			} else if (c == '}' || c == ']') {
+				if (--depth == 0)
+					return p + 1;
+			}
+			p++;
+		}
+		return 0;
+	}
+	while (p < end && *p != ',' && *p != '}' && *p != ']')
+		p++;
+	return p;
+}
+
+const char *ParseNumber(const char *p, const char *end, double *out) {
+	// Integers are by far the common case in minitrace output.
+	const char *q = p;
+	bool neg = false;
+	if (q < end && *q == '-') {
+		neg = true;
+		q++;
+	}
+	int64_t v = 0;
+	const char *digits = q;
+	while (q < end && *q >= '0' && *q <= '9') {
+		v = v * 10 + (*q - '0');
+		q++;
+	}
+	if (q < end && (*q == '.' || *q == 'e' || *q == 'E')) {
+		char buf[64];
+		size_t len = std::min((size_t)(end - p), sizeof(buf) - 1);
+		memcpy(buf, p, len);
+		buf[len] = 0;
+		char *stop;
+		*out = strtod(buf, &stop);
+		return p + (stop - buf);
+	}
+	if (q == digits)
+		return 0;
+	*out = (double)(neg ? -v : v);
+	return q;
+}
+
+bool KeyIs(const StrRef &key, const char *name) {
+	return strlen(name) == key.len && memcmp(key.p, name, key.len) == 0;
+}
+
+class Tokenizer {
+public:
+	explicit Tokenizer(Chunk *chunk) : chunk_(chunk) {}
+
+	void Run() {
+		const char *p = chunk_->begin;
+		const char *end = chunk_->end;
+		while (p < end) {
+			const char *eol = (const char *)memchr(p, '\n', end - p);
+			if (!eol)
+				eol = end;
+			ParseLine(p, eol);
+			p = eol + 1;
+		}
+	}
+
+private:
+	// A line holds zero or more event objects, possibly preceded by the
+	// {"traceEvents":[ header, as when the whole trace is on one line.
+	void ParseLine(const char *p, const char *end) {
+		for (;;) {
+			while (p < end && (*p == ',' || *p == '[' || *p == ']' || *p == '}' || *p == ' ' || *p == '\t' || *p == '\r'))
+				p++;
+			// Trailing keys of the top-level object, like "displayTimeUnit".
+			if (p >= end || *p == '"')
+				return;
+			if (*p != '{') {
+				chunk_->malformed++;
+				return;
+			}
+			const char *next = ParseObject(p, end);
+			if (!next) {
+				chunk_->malformed++;
+				return;
+			}
+			p = next;
+		}
+	}
+
+	const char *ParseObject(const char *p, const char *end) {
+		Event ev;
+		memset(&ev, 0, sizeof(ev));
+		StrRef name = { "", 0 };
+		StrRef cat = { "", 0 };
+		bool has_ph = false;
+		p = SkipWs(p + 1, end);
+		while (p < end && *p != '}') {
+			StrRef key;
+			if (*p != '"' || !(p = ParseString(p, end, &key)))
+				return 0;
+			p = SkipWs(p, end);
+			if (p >= end || *p != ':')
+				return 0;
+			p = SkipWs(p + 1, end);
+			if (KeyIs(key, "traceEvents")) {
+				// The header. Continue with the array contents.
+				return p < end && *p == '[' ? p + 1 : 0;
+			} else if (KeyIs(key, "ph")) {
+				StrRef v;
+				if (*p != '"' || !(p = ParseString(p, end, &v)) || v.len < 1)
+					return 0;
+				ev.ph = v.p[0];
+				has_ph = true;
+			} else if (KeyIs(key, "name") || KeyIs(key, "cat")) {
+				if (*p != '"' || !(p = ParseString(p, end, KeyIs(key, "name") ? &name : &cat)))
+					return 0;
+			} else if (KeyIs(key, "ts") || KeyIs(key, "dur") || KeyIs(key, "pid") || KeyIs(key, "tid")) {
+				double v = 0.0;
+				if (*p == '"') {
+					// Some tools write string pids and tids.
+					StrRef s;
+					if (!(p = ParseString(p, end, &s)))
+						return 0;
+					v = strtod(std::string(s.p, s.len).c_str(), 0);
+				} else if (!(p = ParseNumber(p, end, &v))) {
+					return 0;
+				}
+				if (KeyIs(key, "ts")) ev.ts = v;
+				else if (KeyIs(key, "dur")) ev.dur = v;
+				else if (KeyIs(key, "pid")) ev.pid = (uint32_t)(int64_t)v;
+				else ev.tid = (uint32_t)(int64_t)v;
+			} else if (KeyIs(key, "id")) {
+				if (*p == '"') {
+					StrRef s;
+					if (!(p = ParseString(p, end, &s)))
+						return 0;
+					ev.id = strtoull(std::string(s.p, s.len).c_str(), 0, 0);
+				} else {
+					double v;
+					if (!(p = ParseNumber(p, end, &v)))
+						return 0;
+					ev.id = (uint64_t)v;
+				}
+			} else if (!(p = SkipValue(p, end))) {
+				return 0;
+			}
+			p = SkipWs(p, end);
+			if (p < end && *p == ',')
+				p = SkipWs(p + 1, end);
+		}
+		if (p >= end)
+			return 0;
+		if (has_ph) {
+			ev.name = Intern(name);
+			ev.cat = Intern(cat);
+			chunk_->events.push_back(ev);
+		}
+		return p + 1;
+	}
+
+	uint32_t Intern(const StrRef &s) {
+		std::unordered_map<StrRef, uint32_t, StrRefHash>::iterator it = ids_.find(s);
+		if (it != ids_.end())
+			return it->second;
+		uint32_t id = (uint32_t)chunk_->strings.size();
+		chunk_->strings.push_back(s);
+		ids_[s] = id;
+		return id;
+	}
+
+	Chunk *chunk_;
+	std::unordered_map<StrRef, uint32_t, StrRefHash> ids_;
+};
+
+// Log-linear latency histogram over nanoseconds, 16 sub-buckets per power of two.
+class Histogram {
+public:
+	Histogram() : buckets_(kBuckets, 0) {}
+
+	void Add(double us) {
+		buckets_[Index(us < 0.0 ? 0 : (uint64_t)(us * 1000.0))]++;
+	}
+
+	// Returns the approximate value at quantile q, in microseconds.
+	double Quantile(double q, uint64_t count) const {
+		uint64_t target = (uint64_t)ceil(q * (double)count);
+		if (target == 0)
+			target = 1;
+		uint64_t seen = 0;
+		for (int i = 0; i < kBuckets; i++) {
+			seen += buckets_[i];
+			if (seen >= target)
+				return Midpoint(i) / 1000.0;
+		}
+		return 0.0;
+	}
+
+private:
+	static const int kBuckets = 16 + 60 * 16;
+
+	static int Index(uint64_t ns) {
+		if (ns < 16)
+			return (int)ns;
+		int exp = 63 - __builtin_clzll(ns);
+		return 16 + (exp - 4) * 16 + (int)((ns >> (exp - 4)) & 15);
+	}
+
+	static double Midpoint(int i) {
+		if (i < 16)
+			return i;
+		int exp = (i - 16) / 16 + 4;
+		double width = ldexp(1.0, exp - 4);
+		return ldexp(1.0, exp) + ((i - 16) % 16) * width + width / 2;
+	}
+
+	std::vector<uint32_t> buckets_;
+};
+
+struct NameStats {
+	uint64_t count;
+	double total;
+	double self;
+	double min;
+	double max;
+	Histogram *hist;
+};
+
+struct Instance {
+	double dur;
+	double ts;
+	uint32_t name;
+	uint32_t pid;
+	uint32_t tid;
+	bool operator>(const Instance &o) const {
+		return dur > o.dur;
+	}
+};
+
+struct Slice {
+	double start;
+	double end;
+};
+
+struct OpenSlice {
+	uint32_t name;
+	double start;
+};
+
+// A thread, or an async track. Slices on it nest.
+struct Track {
+	std::vector<OpenSlice> open;
+	std::vector<Slice> pending;
+};
+
+struct Step {
+	uint32_t name;
+	char ph;
+	double ts;
+};
+
+struct Chain {
+	uint32_t name;
+	char kind;
+	uint64_t id;
+	int depth;
+	uint64_t dropped_steps;
+	std::vector<Step> steps;
+};
+
+struct ChainKey {
+	char kind;
+	uint32_t cat;
+	uint32_t name;
+	uint32_t pid;
+	uint64_t id;
+	bool operator==(const ChainKey &o) const {
+		return kind == o.kind && cat == o.cat && name == o.name && pid == o.pid && id == o.id;
+	}
+};
+
+struct ChainKeyHash {
+	size_t operator()(const ChainKey &k) const {
+		return (size_t)(k.id * 0x9E3779B97F4A7C15ULL) ^ ((size_t)k.cat << 1) ^ ((size_t)k.name << 17) ^ ((size_t)k.pid << 33) ^ (size_t)k.kind;
+	}
+};
+
+struct FinishedChain {
+	double dur;
+	Chain chain;
+	bool operator>(const FinishedChain &o) const {
+		return dur > o.dur;
+	}
+};
+
+class Analyzer {
+public:
+	explicit Analyzer(size_t top_n) : top_n_(top_n), events_(0), unmatched_(0), chains_finished_(0) {}
+
+	~Analyzer() {
+		for (size_t i = 0; i < stats_.size(); i++) {
+			delete stats_[i].hist;
+		}
+	}
+
+	// Called in file order.
+	void AddChunk(const Chunk &chunk) {
+		std::vector<uint32_t> remap(chunk.strings.size());
+		for (size_t i = 0; i < chunk.strings.size(); i++) {
+			remap[i] = Intern(std::string(chunk.strings[i].p, chunk.strings[i].len));
+		}
+		for (size_t i = 0; i < chunk.events.size(); i++) {
+			Event ev = chunk.events[i];
+			ev.name = remap[ev.name];
+			ev.cat = remap[ev.cat];
+			Add(ev);
+		}
+	}
+
+	void Report(FILE *out, const char *sort_by, size_t max_names);
+
+	uint64_t events() const { return events_; }
+
+private:
+	uint32_t Intern(const std::string &s) {
+		std::unordered_map<std::string, uint32_t>::iterator it = ids_.find(s);
+		if (it != ids_.end())
+			return it->second;
+		uint32_t id = (uint32_t)names_.size();
+		names_.push_back(s);
+		ids_[s] = id;
+		NameStats st = { 0, 0.0, 0.0, 0.0, 0.0, 0 };
+		stats_.push_back(st);
+		return id;
+	}
+
+	void Add(const Event &ev) {
+		events_++;
+		switch (ev.ph) {
+		case 'B':
+			OnBegin(ThreadTrack(ev), ev.name, ev.ts);
+			break;
+		case 'E':
+			OnEnd(ThreadTrack(ev), ev.ts, ev.pid, ev.tid);
+			break;
+		case 'X':
+			Complete(ThreadTrack(ev), ev.name, ev.ts, ev.ts + ev.dur, ev.pid, ev.tid);
+			break;
+		case 'b':
+		case 'e':
+		case 'n':
+		case 'S':
+		case 'T':
+		case 'F':
+		case 's':
+		case 't':
+		case 'f':
+			OnAsync(ev);
+			break;
+		default:
+			break;
+		}
+	}
+
+	Track &ThreadTrack(const Event &ev) {
+		return threads_[((uint64_t)ev.pid << 32) | ev.tid];
+	}
+
+	void OnBegin(Track &track, uint32_t name, double ts) {
+		OpenSlice s = { name, ts };
+		track.open.push_back(s);
+	}
+
+	void OnEnd(Track &track, double ts, uint32_t pid, uint32_t tid) {
+		if (track.open.empty()) {
+			unmatched_++;
+			return;
+		}
+		OpenSlice s = track.open.back();
+		track.open.pop_back();
+		Complete(track, s.name, s.start, ts, pid, tid);
+	}
+
+	// Slices complete in post-order (children before parents), so the direct
+	// children of a slice are the completed slices it contains at the top of the
+	// pending stack.
+	void Complete(Track &track, uint32_t name, double start, double end, uint32_t pid, uint32_t tid) {
+		double dur = end - start;
+		double children = 0.0;
+		while (!track.pending.empty() && track.pending.back().start >= start && track.pending.back().end <= end) {
+			children += track.pending.back().end - track.pending.back().start;
+			track.pending.pop_back();
+		}
+		Slice s = { start, end };
+		track.pending.push_back(s);
+		if (track.pending.size() > kMaxPending) {
+			track.pending.erase(track.pending.begin(), track.pending.begin() + kMaxPending / 2);
+		}
+
+		NameStats &st = stats_[name];
+		st.count++;
+		st.total += dur;
+		st.self += std::max(0.0, dur - children);
+		st.min = st.count == 1 ? dur : std::min(st.min, dur);
+		st.max = std::max(st.max, dur);
+		if (!st.hist)
+			st.hist = new Histogram();
+		st.hist->Add(dur);
+
+		Instance inst = { dur, start, name, pid, tid };
+		if (slowest_.size() < top_n_) {
+			slowest_.push(inst);
+		} else if (top_n_ && dur > slowest_.top().dur) {
+			slowest_.pop();
+			slowest_.push(inst);
+		}
+	}
+
+	// S/T/F and s/t/f chains are keyed by id (and name, for S/T/F). Nestable b/e/n
+	// events with the same id share one track and end when the outermost slice does.
+	// Flow ids aren't tied to a process, async ids are.
+	void OnAsync(const Event &ev) {
+		ChainKey key;
+		bool starts, ends;
+		switch (ev.ph) {
+		case 's': case 't': case 'f':
+			key.kind = 's';
+			key.name = 0;
+			key.pid = 0;
+			break;
+		case 'S': case 'T': case 'F':
+			key.kind = 'S';
+			key.name = ev.name;
+			key.pid = ev.pid;
+			break;
+		default:
+			key.kind = 'b';
+			key.name = 0;
+			key.pid = ev.pid;
+			break;
+		}
+		key.cat = ev.cat;
+		key.id = ev.id;
+		starts = ev.ph == 's' || ev.ph == 'S' || ev.ph == 'b';
+
+		std::unordered_map<ChainKey, Chain, ChainKeyHash>::iterator it = chains_.find(key);
+		if (it == chains_.end()) {
+			if (!starts) {
+				unmatched_++;
+				return;
+			}
+			Chain c;
+			c.name = ev.name;
+			c.kind = key.kind;
+			c.id = ev.id;
+			c.depth = 0;
+			c.dropped_steps = 0;
+			it = chains_.insert(std::make_pair(key, c)).first;
+		}
+		Chain &chain = it->second;
+		if (chain.steps.size() < kMaxChainSteps) {
+			Step step = { ev.name, ev.ph, ev.ts };
+			chain.steps.push_back(step);
+		} else {
+			chain.dropped_steps++;
+		}
+
+		if (key.kind == 'b') {
+			Track &track = async_tracks_[key];
+			if (ev.ph == 'b') {
+				OnBegin(track, ev.name, ev.ts);
+				chain.depth++;
+			} else if (ev.ph == 'e') {
+				OnEnd(track, ev.ts, ev.pid, ev.tid);
+				chain.depth--;
+			}
+			ends = chain.depth <= 0;
+			if (ends)
+				async_tracks_.erase(key);
+		} else {
+			ends = ev.ph == 'f' || ev.ph == 'F';
+			if (ev.ph == 'F') {
+				Track track;
+				Complete(track, chain.name, chain.steps.front().ts, ev.ts, ev.pid, ev.tid);
+			}
+		}
+
+		if (ends) {
+			FinishChain(chain, ev.ts);
+			chains_.erase(it);
+		}
+	}
+
+	void FinishChain(Chain &chain, double end) {
+		chains_finished_++;
+		double dur = end - chain.steps.front().ts;
+		if (!top_n_)
+			return;
+		if (longest_chains_.size() >= top_n_) {
+			if (dur <= longest_chains_.top().dur)
+				return;
+			longest_chains_.pop();
+		}
+		FinishedChain fc;
+		fc.dur = dur;
+		fc.chain.name = chain.name;
+		fc.chain.kind = chain.kind;
+		fc.chain.id = chain.id;
+		fc.chain.depth = 0;
+		fc.chain.dropped_steps = chain.dropped_steps;
+		fc.chain.steps.swap(chain.steps);
+		longest_chains_.push(fc);
+	}
+
+	size_t top_n_;
+	uint64_t events_;
+	uint64_t unmatched_;
+	uint64_t chains_finished_;
+	std::vector<std::string> names_;
+	std::unordered_map<std::string, uint32_t> ids_;
+	std::vector<NameStats> stats_;
+	std::unordered_map<uint64_t, Track> threads_;
+	std::unordered_map<ChainKey, Track, ChainKeyHash> async_tracks_;
+	std::unordered_map<ChainKey, Chain, ChainKeyHash> chains_;
+	std::priority_queue<Instance, std::vector<Instance>, std::greater<Instance> > slowest_;
+	std::priority_queue<FinishedChain, std::vector<FinishedChain>, std::greater<FinishedChain> > longest_chains_;
+};
+
+// Bucket midpoints can fall outside the observed range.
+double Quantile(const NameStats &st, double q) {
+	return std::min(st.max, std::max(st.min, st.hist->Quantile(q, st.count)));
+}
+
+void Analyzer::Report(FILE *out, const char *sort_by, size_t max_names) {
+	std::vector<uint32_t> order;
+	for (uint32_t i = 0; i < stats_.size(); i++) {
+		if (stats_[i].count)
+			order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		if (!strcmp(sort_by, "self"))
+			return stats_[a].self > stats_[b].self;
+		if (!strcmp(sort_by, "count"))
+			return stats_[a].count > stats_[b].count;
+		return stats_[a].total > stats_[b].total;
+	});
+
+	fprintf(out, "%-40s %10s %12s %12s %10s %10s %10s %10s\n", "name", "count", "total_ms", "self_ms", "p50_us", "p90_us", "p99_us", "max_us");
+	for (size_t i = 0; i < order.size() && i < max_names; i++) {
+		const NameStats &st = stats_[order[i]];
+		fprintf(out, "%-40.40s %10" PRIu64 " %12.3f %12.3f %10.1f %10.1f %10.1f %10.1f\n",
+				names_[order[i]].c_str(), st.count, st.total / 1000.0, st.self / 1000.0,
+				Quantile(st, 0.5), Quantile(st, 0.9), Quantile(st, 0.99), st.max);
+	}
+	if (order.size() > max_names)
+		fprintf(out, "... and %d more\n", (int)(order.size() - max_names));
+
+	std::vector<Instance> slowest;
+	while (!slowest_.empty()) {
+		slowest.push_back(slowest_.top());
+		slowest_.pop();
+	}
+	fprintf(out, "\nSlowest instances:\n");
+	for (size_t i = slowest.size(); i-- > 0;) {
+		const Instance &inst = slowest[i];
+		fprintf(out, "  %12.3f ms  %-40.40s pid %u tid %u at %.3f ms\n",
+				inst.dur / 1000.0, names_[inst.name].c_str(), inst.pid, inst.tid, inst.ts / 1000.0);
+	}
+
+	std::vector<FinishedChain> chains;
+	while (!longest_chains_.empty()) {
+		chains.push_back(longest_chains_.top());
+		longest_chains_.pop();
+	}
+	fprintf(out, "\nCritical path: longest of %" PRIu64 " flow/async chains", chains_finished_);
+	if (!chains_.empty())
+		fprintf(out, " (%d never finished)", (int)chains_.size());
+	fprintf(out, ":\n");
+	for (size_t i = chains.size(); i-- > 0;) {
+		const Chain &c = chains[i].chain;
+		fprintf(out, "  %12.3f ms  %s (%s, id 0x%" PRIx64 ", %d steps)\n", chains[i].dur / 1000.0,
+				names_[c.name].c_str(), c.kind == 's' ? "flow" : "async", c.id, (int)(c.steps.size() + c.dropped_steps));
+		// The segment between two consecutive steps that took longest is the bottleneck.
+		size_t worst = 0;
+		double worst_gap = -1.0;
+		for (size_t j = 1; j < c.steps.size(); j++) {
+			if (c.steps[j].ts - c.steps[j - 1].ts > worst_gap) {
+				worst_gap = c.steps[j].ts - c.steps[j - 1].ts;
+				worst = j;
+			}
+		}
+		if (i + 1 == chains.size()) {
+			for (size_t j = 0; j < c.steps.size(); j++) {
+				fprintf(out, "      +%10.3f ms  %c %s%s\n", (c.steps[j].ts - c.steps[0].ts) / 1000.0, c.steps[j].ph,
+						names_[c.steps[j].name].c_str(), j == worst && worst ? "  <- longest step" : "");
+			}
+		} else if (worst) {
+			fprintf(out, "      longest step: %s -> %s, %.3f ms\n", names_[c.steps[worst - 1].name].c_str(),
+					names_[c.steps[worst].name].c_str(), (c.steps[worst].ts - c.steps[worst - 1].ts) / 1000.0);
+		}
+	}
+	if (unmatched_)
+		fprintf(out, "\n%" PRIu64 " end/step events had no matching begin.\n", unmatched_);
+}
+
+void Usage() {
+	fprintf(stderr, "Usage: mtr_analyze [-n top_n] [-j threads] [-s total|self|count] trace.json\n");
+	exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+	size_t top_n = 10;
+	size_t max_names = 50;
+	int num_threads = (int)std::thread::hardware_concurrency();
+	const char *sort_by = "total";
+	const char *path = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			top_n = (size_t)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			num_threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			sort_by = argv[++i];
+		} else if (argv[i][0] == '-' || path) {
+			Usage();
+		} else {
+			path = argv[i];
+		}
+	}
+	if (!path)
+		Usage();
+	if (num_threads < 1)
+		num_threads = 1;
+
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return 1;
+	}
+
+	Analyzer analyzer(top_n);
+	// Never bigger than the file, so small traces with many threads stay small. One
+	// byte extra makes the first read come up short and see the end of the file.
+	size_t window = std::min(kChunkSize * num_threads, kMaxWindow);
+	if (fseek(file, 0, SEEK_END) == 0) {
+		long file_size = ftell(file);
+		if (file_size >= 0)
+			window = std::min(window, (size_t)file_size + 1);
+		rewind(file);
+	}
+	std::unique_ptr<char[]> buffer(new char[window]);
+	size_t carry = 0;
+	size_t malformed = 0;
+	bool eof = false;
+	while (!eof) {
+		size_t got = fread(buffer.get() + carry, 1, window - carry, file);
+		size_t size = carry + got;
+		eof = got < window - carry;
+		if (size == 0)
+			break;
+		// Leave the incomplete last line for the next window.
+		size_t cut = size;
+		if (!eof) {
+			while (cut > 0 && buffer[cut - 1] != '\n')
+				cut--;
+			if (cut == 0) {
+				std::unique_ptr<char[]> bigger(new char[window * 2]);
+				memcpy(bigger.get(), buffer.get(), size);
+				buffer.swap(bigger);
+				window *= 2;
+				carry = size;
+				continue;
+			}
+		}
+
+		std::vector<Chunk> chunks;
+		const char *p = buffer.get();
+		const char *end = buffer.get() + cut;
+		size_t per_chunk = (cut + num_threads - 1) / num_threads;
+		while (p < end) {
+			const char *q = std::min(p + per_chunk, end);
+			while (q < end && q[-1] != '\n')
+				q++;
+			Chunk chunk;
+			chunk.begin = p;
+			chunk.end = q;
+			chunk.malformed = 0;
+			chunks.push_back(chunk);
+			p = q;
+		}
+		std::vector<std::thread> workers;
+		for (size_t i = 1; i < chunks.size(); i++) {
+			workers.push_back(std::thread([&chunks, i]() { Tokenizer(&chunks[i]).Run(); }));
+		}
+		if (!chunks.empty())
+			Tokenizer(&chunks[0]).Run();
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+		for (size_t i = 0; i < chunks.size(); i++) {
+			analyzer.AddChunk(chunks[i]);
+			malformed += chunks[i].malformed;
+		}
+
+		carry = size - cut;
+		memmove(buffer.get(), buffer.get() + cut, carry);
+	}
+	fclose(file);
+
+	printf("%" PRIu64 " events\n\n", analyzer.events());
+	analyzer.Report(stdout, sort_by, max_names);
+	if (malformed)
+		printf("\nSkipped %d malformed lines.\n", (int)malformed);
+	return 0;
+}